@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +10,23 @@
 #include <dirent.h>
 #include <libgen.h>
 #include <sys/vfs.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/mount.h>
+#include <grp.h>
+#include <signal.h>
+#include <zlib.h>
+#include <linux/keyctl.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <openssl/crypto.h>
 
 #define VERSION "1.0.8"
 #define BUILD_DATE __DATE__ " " __TIME__
@@ -19,6 +37,17 @@
 /* Path buffer plus filename buffer plus separator safety */
 #define PATH_BUFFER_MAX (PATH_MAX + 512)
 #define BAR_WIDTH 40
+/* Files are hashed in chunks of this size so large files spread across threads */
+#define VERIFY_CHUNK (4UL * 1024 * 1024)
+#define VERIFY_MAX_THREADS 16
+#define WALK_MAX_THREADS 16
+#define WALK_DENTS_BUF (256 * 1024)
+#define WALK_ARENA_BLOCK (64 * 1024)
+#define WALK_SPLIT 256
+#define ARCHIVE_BUF (256 * 1024)
+#define BACKUP_LEVEL 9
+#define LEGACY_QUEUE_BYTES (64UL * 1024 * 1024)
+#define LEGACY_INLINE_MAX (8UL * 1024 * 1024)
 
 /* ANSI Color Codes */
 #define RED    "\033[1;31m"
@@ -31,6 +60,7 @@
 char PROFILE_SRC[PATH_MAX], PROFILE_RAM[] = "/dev/shm/vivaldi-profile";
 char BACKUP_DIR[PATH_MAX], SYSTEMD_DIR[PATH_MAX], INSTALL_PATH[PATH_MAX];
 char SERVICE_FILE[PATH_MAX + 128];
+char MANIFEST_DIR[PATH_MAX], MANIFEST_FILE[PATH_MAX + 64];
 
 /* --------------------------------------------------
  * UI & Progress Helpers
@@ -48,6 +78,347 @@ void print_progress(const char* label, double percentage) {
     fflush(stdout);
 }
 
+/* --------------------------------------------------
+ * Tree Walker
+ * -------------------------------------------------- */
+
+/* Every traversal (sizing, load/save sync, backup, verification and backup
+ * listing) goes through walk_tree(). Directories are read with large
+ * getdents64() batches relative to an fd of the walk root, entries are
+ * statx()ed only for the fields the caller asked for, and pending work sits in
+ * a per-thread deque that idle threads steal from. A getdents64() batch larger
+ * than WALK_SPLIT entries is cut into chunks that are stolen like directories,
+ * so a single huge directory (e.g. Cache_Data) is still statx()ed in parallel.
+ * Threads with nothing to steal sleep until new work is pushed. */
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct walk_entry {
+    int dirfd;               /* fd of the parent directory, valid during the callback */
+    const char *name;        /* name relative to dirfd */
+    const char *rel;         /* path relative to the walk root, valid during the callback */
+    unsigned char type;      /* DT_* */
+    int depth;               /* 0 for direct children of the root */
+    int worker;              /* index of the calling thread, 0..nthreads-1 */
+    const struct statx *st;  /* NULL in the filter, or when the walk was started with mask 0 */
+};
+
+/* filter returns 0 to skip an entry (and not descend into it); it runs before
+ * the statx() call, so e->st is NULL there. Both callbacks run concurrently on
+ * all walker threads. */
+typedef int (*walk_filter_fn)(const struct walk_entry *e, void *ctx);
+typedef void (*walk_visit_fn)(const struct walk_entry *e, void *ctx);
+
+/* Directory paths are bump-allocated and released together when the walk ends */
+struct arena_block { struct arena_block *next; size_t used, cap; char data[]; };
+
+char *arena_strdup(struct arena_block **arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    struct arena_block *b = *arena;
+    if (!b || b->cap - b->used < len) {
+        size_t cap = len > WALK_ARENA_BLOCK ? len : WALK_ARENA_BLOCK;
+        b = malloc(sizeof(*b) + cap);
+        if (!b) { fprintf(stderr, RED "Error: Out of memory.\n" RESET); exit(1); }
+        b->next = *arena; b->used = 0; b->cap = cap;
+        *arena = b;
+    }
+    char *p = memcpy(b->data + b->used, s, len);
+    b->used += len;
+    return p;
+}
+
+void arena_free(struct arena_block *b) {
+    while (b) { struct arena_block *next = b->next; free(b); b = next; }
+}
+
+/* An open directory shared by the chunks of its getdents64() batches */
+struct walk_dir { int fd, refs, depth; const char *rel; };
+
+/* Either a directory to scan (dir NULL) or a chunk of dirents from dir */
+struct walk_item { const char *rel; int depth; struct walk_dir *dir; char *dents; long len; };
+
+/* Owner pushes and pops at the tail; thieves take from the head */
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_item *v;
+    size_t head, tail, cap;
+};
+
+struct walk_state;
+
+struct walk_worker {
+    struct walk_state *ws;
+    int id;
+    struct walk_deque dq;
+    struct arena_block *arena;
+    char *dents;
+    char path[PATH_BUFFER_MAX];
+};
+
+struct walk_state {
+    int rootfd;
+    unsigned int mask;
+    walk_filter_fn filter;
+    walk_visit_fn visit;
+    void *ctx;
+    int nthreads;
+    struct walk_worker *workers;
+    size_t pending, pushes;
+    int errors, sleepers;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+};
+
+void deque_push(struct walk_deque *dq, struct walk_item it) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->cap) {
+        if (dq->head > 0) {
+            memmove(dq->v, dq->v + dq->head, (dq->tail - dq->head) * sizeof(*dq->v));
+            dq->tail -= dq->head; dq->head = 0;
+        }
+        if (dq->tail == dq->cap) {
+            dq->cap = dq->cap ? dq->cap * 2 : 256;
+            dq->v = realloc(dq->v, dq->cap * sizeof(*dq->v));
+            if (!dq->v) { fprintf(stderr, RED "Error: Out of memory.\n" RESET); exit(1); }
+        }
+    }
+    dq->v[dq->tail++] = it;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+int deque_take(struct walk_deque *dq, struct walk_item *out, int steal) {
+    int ok = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) {
+        *out = steal ? dq->v[dq->head++] : dq->v[--dq->tail];
+        ok = 1;
+        if (dq->head == dq->tail) dq->head = dq->tail = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+/* Pairs with the sleeper check in walk_worker_main: either the pusher sees the
+ * sleeper or the sleeper sees the new push count */
+void walk_push(struct walk_worker *w, struct walk_item it) {
+    struct walk_state *ws = w->ws;
+    __atomic_fetch_add(&ws->pending, 1, __ATOMIC_RELAXED);
+    deque_push(&w->dq, it);
+    __atomic_fetch_add(&ws->pushes, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ws->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&ws->idle_lock);
+        pthread_cond_signal(&ws->idle);
+        pthread_mutex_unlock(&ws->idle_lock);
+    }
+}
+
+void walk_dir_put(struct walk_dir *dir) {
+    if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) { close(dir->fd); free(dir); }
+}
+
+void walk_entries(struct walk_worker *w, struct walk_dir *dir, const char *dents, long len) {
+    struct walk_state *ws = w->ws;
+    for (long off = 0; off < len;) {
+        const struct linux_dirent64 *d = (const struct linux_dirent64 *)(dents + off);
+        off += d->d_reclen;
+        if (d->d_name[0] == '.' && (!d->d_name[1] || (d->d_name[1] == '.' && !d->d_name[2]))) continue;
+
+        if (dir->rel[0]) snprintf(w->path, sizeof(w->path), "%s/%s", dir->rel, d->d_name);
+        else snprintf(w->path, sizeof(w->path), "%s", d->d_name);
+        struct walk_entry e = { dir->fd, d->d_name, w->path, d->d_type, dir->depth, w->id, NULL };
+
+        struct statx stx;
+        int have = 0;
+        if (e.type == DT_UNKNOWN) {
+            if (statx(dir->fd, d->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, ws->mask | STATX_TYPE, &stx) != 0) continue;
+            e.type = IFTODT(stx.stx_mode);
+            have = 1;
+        }
+        /* Filtered entries are not statx()ed at all */
+        if (ws->filter && !ws->filter(&e, ws->ctx)) continue;
+        if (ws->mask) {
+            if (!have && statx(dir->fd, d->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, ws->mask, &stx) != 0) continue;
+            e.st = &stx;
+        }
+        if (ws->visit) ws->visit(&e, ws->ctx);
+        if (e.type == DT_DIR) walk_push(w, (struct walk_item){ arena_strdup(&w->arena, w->path), dir->depth + 1, NULL, NULL, 0 });
+    }
+}
+
+void walk_scan(struct walk_worker *w, struct walk_item it) {
+    struct walk_state *ws = w->ws;
+    int fd = openat(ws->rootfd, it.rel[0] ? it.rel : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct walk_dir *dir = fd >= 0 ? malloc(sizeof(*dir)) : NULL;
+    if (!dir) { if (fd >= 0) close(fd); __atomic_fetch_add(&ws->errors, 1, __ATOMIC_RELAXED); return; }
+    *dir = (struct walk_dir){ fd, 1, it.depth, it.rel };
+
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, w->dents, WALK_DENTS_BUF)) > 0) {
+        /* Hand out all but the last WALK_SPLIT-entry chunk, which is done here */
+        long start = 0, off = 0;
+        for (int count = 0; off < n; off += ((struct linux_dirent64 *)(w->dents + off))->d_reclen) {
+            if (count++ < WALK_SPLIT) continue;
+            char *chunk = malloc(off - start);
+            if (!chunk) break;
+            memcpy(chunk, w->dents + start, off - start);
+            __atomic_fetch_add(&dir->refs, 1, __ATOMIC_RELAXED);
+            walk_push(w, (struct walk_item){ it.rel, it.depth, dir, chunk, off - start });
+            start = off;
+            count = 1;
+        }
+        walk_entries(w, dir, w->dents + start, n - start);
+    }
+    if (n < 0) __atomic_fetch_add(&ws->errors, 1, __ATOMIC_RELAXED);
+    walk_dir_put(dir);
+}
+
+void *walk_worker_main(void *arg) {
+    struct walk_worker *w = arg;
+    struct walk_state *ws = w->ws;
+    struct walk_item it;
+    for (;;) {
+        size_t seen = __atomic_load_n(&ws->pushes, __ATOMIC_SEQ_CST);
+        int got = deque_take(&w->dq, &it, 0);
+        for (int i = 1; !got && i < ws->nthreads; i++)
+            got = deque_take(&ws->workers[(w->id + i) % ws->nthreads].dq, &it, 1);
+        if (got) {
+            if (it.dir) {
+                walk_entries(w, it.dir, it.dents, it.len);
+                free(it.dents);
+                walk_dir_put(it.dir);
+            } else {
+                walk_scan(w, it);
+            }
+            if (__atomic_sub_fetch(&ws->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+                pthread_mutex_lock(&ws->idle_lock);
+                pthread_cond_broadcast(&ws->idle);
+                pthread_mutex_unlock(&ws->idle_lock);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&ws->idle_lock);
+        __atomic_fetch_add(&ws->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&ws->pending, __ATOMIC_ACQUIRE) != 0 && __atomic_load_n(&ws->pushes, __ATOMIC_SEQ_CST) == seen)
+            pthread_cond_wait(&ws->idle, &ws->idle_lock);
+        __atomic_fetch_sub(&ws->sleepers, 1, __ATOMIC_SEQ_CST);
+        int done = __atomic_load_n(&ws->pending, __ATOMIC_ACQUIRE) == 0;
+        pthread_mutex_unlock(&ws->idle_lock);
+        if (done) break;
+    }
+    return NULL;
+}
+
+int walk_threads(int nthreads) {
+    if (nthreads > 0) return nthreads < WALK_MAX_THREADS ? nthreads : WALK_MAX_THREADS;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > WALK_MAX_THREADS ? WALK_MAX_THREADS : (int)n;
+}
+
+/* Walks everything below root (root itself is not visited). mask selects the
+ * statx() fields callbacks need; nthreads 0 uses every online CPU. Returns -1
+ * if root cannot be opened, otherwise the number of unreadable directories. */
+int walk_tree(const char *root, unsigned int mask, walk_filter_fn filter, walk_visit_fn visit, void *ctx, int nthreads) {
+    struct walk_state ws = { .mask = mask, .filter = filter, .visit = visit, .ctx = ctx, .pending = 1 };
+    pthread_mutex_init(&ws.idle_lock, NULL);
+    pthread_cond_init(&ws.idle, NULL);
+    ws.rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ws.rootfd < 0) return -1;
+    ws.nthreads = walk_threads(nthreads);
+    ws.workers = calloc(ws.nthreads, sizeof(*ws.workers));
+    if (!ws.workers) { close(ws.rootfd); return -1; }
+    for (int i = 0; i < ws.nthreads; i++) {
+        struct walk_worker *w = &ws.workers[i];
+        w->ws = &ws; w->id = i;
+        pthread_mutex_init(&w->dq.lock, NULL);
+        w->dents = malloc(WALK_DENTS_BUF);
+        if (!w->dents) { fprintf(stderr, RED "Error: Out of memory.\n" RESET); exit(1); }
+    }
+    deque_push(&ws.workers[0].dq, (struct walk_item){ "", 0, NULL, NULL, 0 });
+
+    pthread_t tids[WALK_MAX_THREADS];
+    int started[WALK_MAX_THREADS] = {0};
+    for (int i = 1; i < ws.nthreads; i++)
+        started[i] = pthread_create(&tids[i], NULL, walk_worker_main, &ws.workers[i]) == 0;
+    walk_worker_main(&ws.workers[0]);
+    for (int i = 1; i < ws.nthreads; i++) if (started[i]) pthread_join(tids[i], NULL);
+
+    for (int i = 0; i < ws.nthreads; i++) {
+        struct walk_worker *w = &ws.workers[i];
+        free(w->dq.v); free(w->dents); arena_free(w->arena);
+        pthread_mutex_destroy(&w->dq.lock);
+    }
+    free(ws.workers);
+    pthread_cond_destroy(&ws.idle);
+    pthread_mutex_destroy(&ws.idle_lock);
+    close(ws.rootfd);
+    return ws.errors;
+}
+
+/* Flat, sortable entry lists built on top of the walker */
+struct sync_entry {
+    char *rel;
+    mode_t mode;
+    off_t size;
+    long long atime_ns, mtime_ns, ctime_ns, disk_ctime_ns;
+    uint64_t hash;
+    int verified;
+};
+
+struct sync_list { struct sync_entry *v; size_t n, cap; pthread_mutex_t lock; };
+
+struct sync_entry *sync_list_add(struct sync_list *l) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 1024;
+        l->v = realloc(l->v, l->cap * sizeof(*l->v));
+        if (!l->v) { fprintf(stderr, RED "Error: Out of memory.\n" RESET); exit(1); }
+    }
+    memset(&l->v[l->n], 0, sizeof(*l->v));
+    return &l->v[l->n++];
+}
+
+void sync_list_free(struct sync_list *l) {
+    for (size_t i = 0; i < l->n; i++) free(l->v[i].rel);
+    free(l->v);
+    l->v = NULL; l->n = l->cap = 0;
+}
+
+int sync_entry_cmp(const void *a, const void *b) {
+    return strcmp(((const struct sync_entry *)a)->rel, ((const struct sync_entry *)b)->rel);
+}
+
+long long statx_mtime_ns(const struct statx *st) {
+    return (long long)st->stx_mtime.tv_sec * 1000000000LL + st->stx_mtime.tv_nsec;
+}
+
+void collect_visit(const struct walk_entry *e, void *ctx) {
+    struct sync_list *l = ctx;
+    char *rel = strdup(e->rel);
+    pthread_mutex_lock(&l->lock);
+    struct sync_entry *s = sync_list_add(l);
+    s->rel = rel;
+    s->mode = e->st->stx_mode;
+    s->size = e->st->stx_size;
+    s->atime_ns = (long long)e->st->stx_atime.tv_sec * 1000000000LL + e->st->stx_atime.tv_nsec;
+    s->mtime_ns = statx_mtime_ns(e->st);
+    s->ctime_ns = (long long)e->st->stx_ctime.tv_sec * 1000000000LL + e->st->stx_ctime.tv_nsec;
+    pthread_mutex_unlock(&l->lock);
+}
+
+/* Collects the tree below root into out, sorted by relative path */
+int collect_tree(const char *root, walk_filter_fn filter, struct sync_list *out, int nthreads) {
+    pthread_mutex_init(&out->lock, NULL);
+    int rc = walk_tree(root, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_ATIME | STATX_MTIME | STATX_CTIME, filter, collect_visit, out, nthreads);
+    pthread_mutex_destroy(&out->lock);
+    if (out->n) qsort(out->v, out->n, sizeof(*out->v), sync_entry_cmp);
+    return rc != 0 ? -1 : 0;
+}
+
 /* --------------------------------------------------
  * Helper Functions
  * -------------------------------------------------- */
@@ -60,10 +431,8 @@ void init_paths() {
     snprintf(SYSTEMD_DIR, PATH_MAX, "%s/.config/systemd/user", home);
     snprintf(INSTALL_PATH, PATH_MAX, "%s/.local/bin/vivaldi-ram-profile", home);
     snprintf(SERVICE_FILE, sizeof(SERVICE_FILE), "%s/vivaldi-ram-profile.service", SYSTEMD_DIR);
-}
-
-int is_rsync_installed() {
-    return (system("command -v rsync >/dev/null 2>&1") == 0);
+    snprintf(MANIFEST_DIR, PATH_MAX, "%s/.cache/vivaldi-ram-profile", home);
+    snprintf(MANIFEST_FILE, sizeof(MANIFEST_FILE), "%s/verify.manifest", MANIFEST_DIR);
 }
 
 int is_vivaldi_running() {
@@ -76,6 +445,12 @@ int is_mounted() {
     return (system(cmd) == 0);
 }
 
+int has_flag(int argc, char *argv[], const char *flag) {
+    for (int i = 2; i < argc; i++) if (strcmp(argv[i], flag) == 0) return 1;
+    return 0;
+}
+
+
 int confirm(const char *msg) {
     printf("%s [y/N]: ", msg);
     char buf[10];
@@ -83,15 +458,26 @@ int confirm(const char *msg) {
     return 0;
 }
 
+void size_visit(const struct walk_entry *e, void *ctx) {
+    __atomic_fetch_add((unsigned long *)ctx, (unsigned long)e->st->stx_size, __ATOMIC_RELAXED);
+}
+
 unsigned long get_dir_size(const char *path) {
-    char cmd[CMD_MAX];
-    snprintf(cmd, sizeof(cmd), "du -sb \"%s\" 2>/dev/null", path);
-    FILE *fp = popen(cmd, "r");
     unsigned long size = 0;
-    if (fp) { if (fscanf(fp, "%lu", &size) != 1) size = 0; pclose(fp); }
+    if (walk_tree(path, STATX_SIZE, NULL, size_visit, &size, 0) < 0) return 0;
     return size;
 }
 
+int backup_filter(const struct walk_entry *e, void *ctx) {
+    (void)ctx;
+    return e->type == DT_REG && strstr(e->name, ".zip") != NULL;
+}
+
+/* Lists the *.zip files directly inside BACKUP_DIR, sorted by name */
+int list_backups(struct sync_list *out) {
+    return collect_tree(BACKUP_DIR, backup_filter, out, 1);
+}
+
 void handle_check_ram() {
     unsigned long profile_size = get_dir_size(PROFILE_SRC);
     struct statfs s;
@@ -115,29 +501,23 @@ void show_status() {
     printf("=== RAM status ===\n  RAM active : %s\n\n", is_mounted() ? "yes" : "no");
     printf("=== Vivaldi status ===\n  Running    : %s\n\n", is_vivaldi_running() ? "yes" : "no");
     
-    DIR *d = opendir(BACKUP_DIR);
+    struct sync_list backups = {0};
     int count = 0;
     char latest[PATH_MAX] = "none";
-    time_t ltime = 0;
+    long long ltime = 0;
     off_t lsize = 0;
 
-    if (d) {
-        struct dirent *dir;
-        while ((dir = readdir(d))) {
-            if (strstr(dir->d_name, ".zip")) {
-                count++;
-                char p[PATH_BUFFER_MAX];
-                snprintf(p, sizeof(p), "%s/%s", BACKUP_DIR, dir->d_name);
-                struct stat st;
-                if (stat(p, &st) == 0 && st.st_mtime > ltime) {
-                    ltime = st.st_mtime;
-                    lsize = st.st_size;
-                    strncpy(latest, dir->d_name, PATH_MAX);
-                }
+    if (list_backups(&backups) == 0) {
+        count = backups.n;
+        for (size_t i = 0; i < backups.n; i++) {
+            if (backups.v[i].mtime_ns > ltime) {
+                ltime = backups.v[i].mtime_ns;
+                lsize = backups.v[i].size;
+                snprintf(latest, sizeof(latest), "%s", backups.v[i].rel);
             }
         }
-        closedir(d);
     }
+    sync_list_free(&backups);
 
     printf("=== Backup status ===\n");
     printf("  Path       : %s\n", BACKUP_DIR);
@@ -163,9 +543,14 @@ void show_usage(const char *prog_path) {
     printf("  -s, --save            Save RAM profile back to disk\n");
     printf("  -S, --status          Show RAM and backup status\n");
     printf("  -c, --check-ram       Check profile size vs available RAM\n");
-    printf("  -b, --backup          Create ZIP backup (RAM must be active)\n");
-    printf("  -R, --restore         Restore the latest backup\n");
+    printf("  -V, --verify-sync     Verify RAM and disk copies match (--full to re-hash all)\n");
+    printf("                        Also accepted after -l/-s to verify before mount/cleanup\n");
+    printf("      --checkpoint      Flush dirty files to disk before sleep (run by the sleep hook)\n");
+    printf("  -b, --backup [-]      Create ZIP backup (RAM must be active), '-' streams to stdout\n");
+    printf("  -R, --restore [-]     Restore the latest backup, '-' reads a backup from stdin\n");
     printf("  -e, --restore-select  Restore a selected backup (interactive)\n");
+    printf("      --keyfile FILE    Encrypt (-b) or decrypt (-R/-e) backups with a key file\n");
+    printf("      --keyring DESC    Same, using a 'user' key from the kernel keyring\n");
     printf("  -n, --clean-backup    Delete all backups except the latest\n");
     printf("  -p, --purge-backup    Delete ALL backup files\n");
     printf("  -h, --sudo-help       Show password-less sudo mount instructions\n\n");
@@ -193,11 +578,1792 @@ void show_sudo_help() {
 
 }
 
+/* --------------------------------------------------
+ * Sync Verification
+ * -------------------------------------------------- */
+
+/* Portable scalar XXH64 (four independent accumulator lanes, no SIMD) */
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+uint64_t xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+uint64_t xxh_round(uint64_t acc, uint64_t in) { acc += in * XXH_P2; return xxh_rotl(acc, 31) * XXH_P1; }
+uint64_t xxh_merge(uint64_t acc, uint64_t v) { acc ^= xxh_round(0, v); return acc * XXH_P1 + XXH_P4; }
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = data, *end = p + len;
+    uint64_t h, k;
+    uint32_t w;
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2, v3 = seed, v4 = seed - XXH_P1;
+        do {
+            memcpy(&k, p, 8);      v1 = xxh_round(v1, k);
+            memcpy(&k, p + 8, 8);  v2 = xxh_round(v2, k);
+            memcpy(&k, p + 16, 8); v3 = xxh_round(v3, k);
+            memcpy(&k, p + 24, 8); v4 = xxh_round(v4, k);
+            p += 32;
+        } while (end - p >= 32);
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(h, v1); h = xxh_merge(h, v2); h = xxh_merge(h, v3); h = xxh_merge(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+    h += len;
+    for (; end - p >= 8; p += 8) { memcpy(&k, p, 8); h ^= xxh_round(0, k); h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4; }
+    if (end - p >= 4) { memcpy(&w, p, 4); h ^= (uint64_t)w * XXH_P1; h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3; p += 4; }
+    for (; p < end; p++) { h ^= *p * XXH_P5; h = xxh_rotl(h, 11) * XXH_P1; }
+    h ^= h >> 33; h *= XXH_P2; h ^= h >> 29; h *= XXH_P3; h ^= h >> 32;
+    return h;
+}
+
+/* Manifest lines: <hash> <size> <mtime_ns> <ram ctime_ns> <disk ctime_ns> <relative path>.
+ * A copy keeps the mtime but always gets a new ctime, so ctime tells which side changed. */
+void load_manifest(struct sync_list *m) {
+    FILE *f = fopen(MANIFEST_FILE, "r");
+    if (!f) return;
+    char line[PATH_BUFFER_MAX + 128], rel[PATH_BUFFER_MAX];
+    unsigned long long hash; long long size, mtime, ram_ctime, disk_ctime;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%16llx %lld %lld %lld %lld %[^\n]", &hash, &size, &mtime, &ram_ctime, &disk_ctime, rel) != 6) continue;
+        struct sync_entry *e = sync_list_add(m);
+        e->rel = strdup(rel); e->hash = hash; e->size = size; e->mtime_ns = mtime;
+        e->ctime_ns = ram_ctime; e->disk_ctime_ns = disk_ctime;
+    }
+    fclose(f);
+    if (m->n) qsort(m->v, m->n, sizeof(*m->v), sync_entry_cmp);
+}
+
+void save_manifest(const struct sync_list *l) {
+    char cmd[CMD_MAX], tmp[PATH_BUFFER_MAX];
+    snprintf(cmd, sizeof(cmd), "mkdir -p \"%s\"", MANIFEST_DIR); system(cmd);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", MANIFEST_FILE);
+    FILE *f = fopen(tmp, "w");
+    if (!f) return;
+    for (size_t i = 0; i < l->n; i++) {
+        const struct sync_entry *e = &l->v[i];
+        if (e->verified) fprintf(f, "%016llx %lld %lld %lld %lld %s\n", (unsigned long long)e->hash, (long long)e->size,
+                                 e->mtime_ns, e->ctime_ns, e->disk_ctime_ns, e->rel);
+    }
+    if (fclose(f) == 0) rename(tmp, MANIFEST_FILE);
+    else remove(tmp);
+}
+
+/* side: VERIFY_BOTH compares the copies byte for byte, otherwise only that side is hashed
+ * and checked against the manifest hash recorded for the unchanged side */
+enum { VERIFY_BOTH, VERIFY_RAM, VERIFY_DISK };
+struct verify_item { struct sync_entry *ram; uint64_t *chunk_hash, expect; long nchunks; int side, mismatch; };
+struct verify_work { struct verify_item *item; long chunk; };
+struct verify_job {
+    const char *ram_root, *disk_root;
+    struct verify_work *work;
+    size_t nwork, next;
+    unsigned long long bytes_done;
+    int running;
+};
+
+int read_chunk(const char *root, const char *rel, off_t off, size_t len, unsigned char *buf) {
+    char p[PATH_BUFFER_MAX];
+    snprintf(p, sizeof(p), "%s/%s", root, rel);
+    int fd = open(p, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return -1;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(fd, buf + got, len - got, off + got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+    return got == len ? 0 : -1;
+}
+
+/* Workers pull (file, chunk) pairs from a shared cursor. A chunk is read from
+ * one side and hashed; for VERIFY_BOTH the other side is compared against it. */
+void *verify_worker(void *arg) {
+    struct verify_job *job = arg;
+    unsigned char *a = malloc(VERIFY_CHUNK), *b = malloc(VERIFY_CHUNK);
+    size_t w;
+    while (a && b && (w = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nwork) {
+        struct verify_item *it = job->work[w].item;
+        off_t off = (off_t)job->work[w].chunk * VERIFY_CHUNK;
+        size_t len = it->ram->size - off < (off_t)VERIFY_CHUNK ? (size_t)(it->ram->size - off) : VERIFY_CHUNK;
+        const char *root = it->side == VERIFY_DISK ? job->disk_root : job->ram_root;
+        if (read_chunk(root, it->ram->rel, off, len, a) != 0 ||
+            (it->side == VERIFY_BOTH && (read_chunk(job->disk_root, it->ram->rel, off, len, b) != 0 || memcmp(a, b, len) != 0))) {
+            __atomic_store_n(&it->mismatch, 1, __ATOMIC_RELAXED);
+        } else {
+            it->chunk_hash[job->work[w].chunk] = xxh64(a, len, (uint64_t)off);
+        }
+        __atomic_fetch_add(&job->bytes_done, len, __ATOMIC_RELAXED);
+    }
+    free(a); free(b);
+    __atomic_fetch_sub(&job->running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int links_match(const char *ram_root, const char *disk_root, const char *rel) {
+    char p[PATH_BUFFER_MAX], a[PATH_MAX], b[PATH_MAX];
+    snprintf(p, sizeof(p), "%s/%s", ram_root, rel);
+    ssize_t na = readlink(p, a, sizeof(a));
+    snprintf(p, sizeof(p), "%s/%s", disk_root, rel);
+    ssize_t nb = readlink(p, b, sizeof(b));
+    return na >= 0 && na == nb && memcmp(a, b, na) == 0;
+}
+
+/* Returns the number of mismatches, or -1 if the trees could not be scanned.
+ * Unless full is set, files unchanged on both sides since they were last
+ * verified are skipped, and files changed on one side only (e.g. the fresh
+ * RAM copy after --load) are read from that side alone. */
+int verify_sync(const char *ram_root, const char *disk_root, int full) {
+    struct sync_list ram = {0}, disk = {0}, manifest = {0};
+    if (collect_tree(ram_root, NULL, &ram, 0) != 0 || collect_tree(disk_root, NULL, &disk, 0) != 0) {
+        printf(RED "Error: Could not scan profile trees.\n" RESET);
+        sync_list_free(&ram); sync_list_free(&disk);
+        return -1;
+    }
+    if (!full) load_manifest(&manifest);
+
+    struct verify_item *items = calloc(ram.n + 1, sizeof(*items));
+    size_t nitems = 0, nwork = 0, i = 0, j = 0;
+    unsigned long long total = 0;
+    int mismatches = 0, cached = 0, one_side = 0;
+
+    printf("Verifying %s against %s...\n", ram_root, disk_root);
+    while (i < ram.n || j < disk.n) {
+        int c = i >= ram.n ? 1 : j >= disk.n ? -1 : strcmp(ram.v[i].rel, disk.v[j].rel);
+        if (c < 0) { printf(RED "  Missing on disk : %s\n" RESET, ram.v[i++].rel); mismatches++; continue; }
+        if (c > 0) { printf(RED "  Missing in RAM  : %s\n" RESET, disk.v[j++].rel); mismatches++; continue; }
+        struct sync_entry *r = &ram.v[i++], *d = &disk.v[j++];
+        if ((r->mode & S_IFMT) != (d->mode & S_IFMT)) {
+            printf(RED "  Type differs    : %s\n" RESET, r->rel); mismatches++;
+        } else if (S_ISLNK(r->mode)) {
+            if (!links_match(ram_root, disk_root, r->rel)) { printf(RED "  Link differs    : %s\n" RESET, r->rel); mismatches++; }
+        } else if (S_ISREG(r->mode)) {
+            if (r->size != d->size) { printf(RED "  Size differs    : %s\n" RESET, r->rel); mismatches++; continue; }
+            r->disk_ctime_ns = d->ctime_ns;
+            struct sync_entry *m = manifest.n ? bsearch(r, manifest.v, manifest.n, sizeof(*manifest.v), sync_entry_cmp) : NULL;
+            int same = m && m->size == r->size && m->mtime_ns == r->mtime_ns && m->mtime_ns == d->mtime_ns;
+            int ram_known = same && m->ctime_ns == r->ctime_ns, disk_known = same && m->disk_ctime_ns == d->ctime_ns;
+            if (ram_known && disk_known) {
+                r->hash = m->hash; r->verified = 1; cached++;
+                continue;
+            }
+            struct verify_item *it = &items[nitems++];
+            it->ram = r;
+            it->side = ram_known ? VERIFY_DISK : disk_known ? VERIFY_RAM : VERIFY_BOTH;
+            it->expect = same ? m->hash : 0;
+            if (it->side != VERIFY_BOTH) one_side++;
+            it->nchunks = (r->size + VERIFY_CHUNK - 1) / VERIFY_CHUNK;
+            it->chunk_hash = calloc(it->nchunks + 1, sizeof(uint64_t));
+            nwork += it->nchunks;
+            total += r->size;
+        }
+    }
+
+    struct verify_job job = { ram_root, disk_root, calloc(nwork + 1, sizeof(struct verify_work)), nwork, 0, 0, 0 };
+    size_t k = 0;
+    for (size_t n = 0; n < nitems; n++)
+        for (long c = 0; c < items[n].nchunks; c++) job.work[k++] = (struct verify_work){ &items[n], c };
+
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > VERIFY_MAX_THREADS) nthreads = VERIFY_MAX_THREADS;
+    if ((size_t)nthreads > nwork) nthreads = nwork ? (long)nwork : 1;
+    pthread_t tids[VERIFY_MAX_THREADS];
+    int started = 0;
+    job.running = nthreads;
+    for (long t = 0; t < nthreads; t++) {
+        if (pthread_create(&tids[started], NULL, verify_worker, &job) == 0) started++;
+        else __atomic_fetch_sub(&job.running, 1, __ATOMIC_RELAXED);
+    }
+    if (started == 0) { job.running = 1; verify_worker(&job); }
+    while (__atomic_load_n(&job.running, __ATOMIC_ACQUIRE) > 0) {
+        print_progress("Verifying", (double)__atomic_load_n(&job.bytes_done, __ATOMIC_RELAXED) / (total ? total : 1));
+        usleep(100000);
+    }
+    for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    print_progress("Verifying", 1.0);
+    printf("\n");
+
+    for (size_t n = 0; n < nitems; n++) {
+        struct verify_item *it = &items[n];
+        uint64_t hash = xxh64(it->chunk_hash, it->nchunks * sizeof(uint64_t), (uint64_t)it->ram->size);
+        if (it->mismatch || (it->side != VERIFY_BOTH && hash != it->expect)) {
+            printf(RED "  Content differs : %s\n" RESET, it->ram->rel); mismatches++;
+        } else {
+            it->ram->hash = hash;
+            it->ram->verified = 1;
+        }
+        free(it->chunk_hash);
+    }
+    save_manifest(&ram);
+
+    printf("Checked %zu files (%d unchanged since last verification, %d read from one side only, %.2f MB checked).\n",
+           nitems + cached, cached, one_side, (double)total / (1024 * 1024));
+    if (mismatches) printf(RED "%d mismatches between RAM and disk.\n" RESET, mismatches);
+    else printf(GREEN "RAM and disk copies match.\n" RESET);
+
+    free(job.work); free(items);
+    sync_list_free(&ram); sync_list_free(&disk); sync_list_free(&manifest);
+    return mismatches;
+}
+
+int handle_verify_sync(int full) {
+    struct stat st;
+    if (is_mounted()) {
+        printf(YELLOW "The disk copy is hidden while the profile is mounted.\n"
+               "Use --load --verify-sync or --save --verify-sync instead.\n" RESET);
+        return 1;
+    }
+    if (stat(PROFILE_RAM, &st) != 0) { printf(YELLOW "No RAM copy to verify against.\n" RESET); return 1; }
+    return verify_sync(PROFILE_RAM, PROFILE_SRC, full) == 0 ? 0 : 1;
+}
+
+/* --------------------------------------------------
+ * Tree Sync
+ * -------------------------------------------------- */
+
+/* Mirrors src into dst like `rsync -a --delete`: extraneous entries are
+ * removed first, then files whose size or mtime differ are copied in parallel
+ * by the walker threads (unchanged ones only get their mode fixed), and
+ * directory modes/mtimes are fixed up last. */
+
+struct sync_ctx {
+    int src_fd, dst_fd;
+    const char *label;
+    unsigned long long total, done;
+    int errors, shown;
+    struct sync_list extra, src;
+    size_t next;
+};
+
+int same_type_in(int fd, const char *rel, unsigned char type) {
+    struct stat st;
+    return fstatat(fd, rel, &st, AT_SYMLINK_NOFOLLOW) == 0 && IFTODT(st.st_mode) == type;
+}
+
+/* Delete pass: records every dst entry with no same-typed counterpart in src */
+int sync_extra_filter(const struct walk_entry *e, void *ctx) {
+    struct sync_ctx *sc = ctx;
+    if (same_type_in(sc->src_fd, e->rel, e->type)) return 1;
+    char *rel = strdup(e->rel);
+    pthread_mutex_lock(&sc->extra.lock);
+    struct sync_entry *s = sync_list_add(&sc->extra);
+    s->rel = rel;
+    s->mode = DTTOIF(e->type);
+    pthread_mutex_unlock(&sc->extra.lock);
+    return 1;
+}
+
+int copy_fd(int in, int out, off_t size) {
+    off_t left = size;
+    while (left > 0) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, left, 0);
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) break;
+        if (n <= 0) return n == 0 ? 0 : -1;
+        left -= n;
+    }
+    while (left > 0) {
+        ssize_t n = sendfile(out, in, NULL, left);
+        if (n <= 0) return n == 0 ? 0 : -1;
+        left -= n;
+    }
+    return 0;
+}
+
+/* Files are written to a temporary name and renamed into place */
+/* Copies s into tmp below dst with its mode and times; the caller renames or removes tmp */
+int sync_copy_tmp(struct sync_ctx *sc, const struct sync_entry *s, const char *tmp) {
+    int in = openat(sc->src_fd, s->rel, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in < 0) return -1;
+    int out = openat(sc->dst_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (out < 0) { close(in); return -1; }
+    struct timespec ts[2] = { { s->atime_ns / 1000000000LL, s->atime_ns % 1000000000LL }, { s->mtime_ns / 1000000000LL, s->mtime_ns % 1000000000LL } };
+    int rc = copy_fd(in, out, s->size);
+    if (rc == 0) rc = fchmod(out, s->mode & 07777);
+    if (rc == 0) rc = futimens(out, ts);
+    close(in);
+    if (close(out) != 0) rc = -1;
+    return rc;
+}
+
+int sync_copy_file(struct sync_ctx *sc, const struct sync_entry *s) {
+    char tmp[PATH_BUFFER_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.vrpm-tmp", s->rel);
+    int rc = sync_copy_tmp(sc, s, tmp);
+    if (rc == 0) rc = renameat(sc->dst_fd, tmp, sc->dst_fd, s->rel);
+    if (rc != 0) unlinkat(sc->dst_fd, tmp, 0);
+    return rc;
+}
+
+int sync_copy_link(struct sync_ctx *sc, const struct sync_entry *s) {
+    char target[PATH_MAX], cur[PATH_MAX];
+    ssize_t n = readlinkat(sc->src_fd, s->rel, target, sizeof(target) - 1);
+    if (n < 0) return -1;
+    target[n] = '\0';
+    ssize_t m = readlinkat(sc->dst_fd, s->rel, cur, sizeof(cur) - 1);
+    if (m == n && memcmp(cur, target, n) == 0) return 0;
+    if (m >= 0) unlinkat(sc->dst_fd, s->rel, 0);
+    if (symlinkat(target, sc->dst_fd, s->rel) != 0) return -1;
+    struct timespec ts[2] = { { 0, UTIME_OMIT }, { s->mtime_ns / 1000000000LL, s->mtime_ns % 1000000000LL } };
+    utimensat(sc->dst_fd, s->rel, ts, AT_SYMLINK_NOFOLLOW);
+    return 0;
+}
+
+/* Copy pass: workers pull files and links from the collected source list */
+struct sync_worker { struct sync_ctx *sc; int id; };
+
+void *sync_copy_worker(void *arg) {
+    struct sync_worker *sw = arg;
+    struct sync_ctx *sc = sw->sc;
+    struct stat st;
+    size_t i;
+    while ((i = __atomic_fetch_add(&sc->next, 1, __ATOMIC_RELAXED)) < sc->src.n) {
+        const struct sync_entry *s = &sc->src.v[i];
+        int rc = 0;
+        if (S_ISLNK(s->mode)) {
+            rc = sync_copy_link(sc, s);
+        } else if (S_ISREG(s->mode)) {
+            int fresh = fstatat(sc->dst_fd, s->rel, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) && st.st_size == s->size &&
+                        (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec == s->mtime_ns;
+            if (!fresh) rc = sync_copy_file(sc, s);
+            else if ((st.st_mode & 07777) != (s->mode & 07777)) rc = fchmodat(sc->dst_fd, s->rel, s->mode & 07777, 0);
+            unsigned long long done = __atomic_add_fetch(&sc->done, s->size, __ATOMIC_RELAXED);
+            int permille = (int)(done * 1000 / (sc->total ? sc->total : 1));
+            if (sw->id == 0 && permille != sc->shown) { sc->shown = permille; print_progress(sc->label, permille / 1000.0); }
+        } else {
+            continue;
+        }
+        if (rc != 0) {
+            __atomic_fetch_add(&sc->errors, 1, __ATOMIC_RELAXED);
+            fprintf(stderr, RED "\nError: Could not copy %s\n" RESET, s->rel);
+        }
+    }
+    return NULL;
+}
+
+void apply_dir_attrs(int fd, const char *rel, mode_t mode, long long mtime_ns) {
+    struct timespec ts[2] = { { 0, UTIME_OMIT }, { mtime_ns / 1000000000LL, mtime_ns % 1000000000LL } };
+    fchmodat(fd, rel, mode & 07777, 0);
+    utimensat(fd, rel, ts, AT_SYMLINK_NOFOLLOW);
+}
+
+/* Returns the number of entries that could not be copied or removed, or -1 */
+int sync_tree(const char *src, const char *dst, const char *label) {
+    struct sync_ctx sc = { .label = label };
+    struct stat root;
+    sc.src_fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    sc.dst_fd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (sc.src_fd < 0 || sc.dst_fd < 0 || fstat(sc.src_fd, &root) != 0) {
+        if (sc.src_fd >= 0) close(sc.src_fd);
+        if (sc.dst_fd >= 0) close(sc.dst_fd);
+        return -1;
+    }
+    pthread_mutex_init(&sc.extra.lock, NULL);
+
+    if (walk_tree(dst, 0, sync_extra_filter, NULL, &sc, 0) < 0) sc.errors++;
+    /* Sorted order puts children after their parent, so delete back to front */
+    if (sc.extra.n) qsort(sc.extra.v, sc.extra.n, sizeof(*sc.extra.v), sync_entry_cmp);
+    for (size_t i = sc.extra.n; i-- > 0;) {
+        const struct sync_entry *x = &sc.extra.v[i];
+        if (unlinkat(sc.dst_fd, x->rel, S_ISDIR(x->mode) ? AT_REMOVEDIR : 0) != 0 && errno != ENOENT) sc.errors++;
+    }
+
+    /* One walk of the source gives both the progress total and the work list;
+     * directories are created in path order before files are copied into them */
+    if (collect_tree(src, NULL, &sc.src, 0) != 0) sc.errors++;
+    for (size_t i = 0; i < sc.src.n; i++) {
+        const struct sync_entry *x = &sc.src.v[i];
+        if (S_ISREG(x->mode)) sc.total += x->size;
+        else if (S_ISDIR(x->mode) && mkdirat(sc.dst_fd, x->rel, 0700) != 0 && errno != EEXIST) {
+            sc.errors++;
+            fprintf(stderr, RED "\nError: Could not copy %s\n" RESET, x->rel);
+        }
+    }
+
+    int nthreads = walk_threads(0), started = 0;
+    pthread_t tids[WALK_MAX_THREADS];
+    struct sync_worker workers[WALK_MAX_THREADS];
+    for (int i = 1; i < nthreads; i++) {
+        workers[i] = (struct sync_worker){ &sc, i };
+        if (pthread_create(&tids[started], NULL, sync_copy_worker, &workers[i]) == 0) started++;
+    }
+    workers[0] = (struct sync_worker){ &sc, 0 };
+    sync_copy_worker(&workers[0]);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    print_progress(label, 1.0);
+
+    for (size_t i = 0; i < sc.src.n; i++)
+        if (S_ISDIR(sc.src.v[i].mode)) apply_dir_attrs(sc.dst_fd, sc.src.v[i].rel, sc.src.v[i].mode, sc.src.v[i].mtime_ns);
+    apply_dir_attrs(sc.dst_fd, ".", root.st_mode, (long long)root.st_mtim.tv_sec * 1000000000LL + root.st_mtim.tv_nsec);
+
+    pthread_mutex_destroy(&sc.extra.lock);
+    sync_list_free(&sc.extra); sync_list_free(&sc.src);
+    close(sc.src_fd); close(sc.dst_fd);
+    return sc.errors;
+}
+
+/* --------------------------------------------------
+ * Sleep Checkpoint
+ * -------------------------------------------------- */
+
+/* Run by the system-sleep hook before suspend/hibernate. The RAM copy is
+ * flushed to disk incrementally within a fixed time budget: session-critical
+ * files are looked up directly and copied first, then the rest of the tree is
+ * walked for dirty files until the deadline. Files that would not fit in the
+ * remaining time are skipped, as are deletions; the next --save catches up. */
+
+#define CHECKPOINT_BUDGET_MS 800
+#define CHECKPOINT_MIN_RATE  50000 /* bytes/ms assumed before a megabyte has been copied */
+#define CHECKPOINT_BIN  "/usr/local/libexec/vivaldi-ram-profile"
+#define CHECKPOINT_HOOK "/usr/lib/systemd/system-sleep/vivaldi-ram-profile"
+
+const char *CHECKPOINT_SKIP[] = { "Cache", "Code Cache", "GPUCache", "GrShaderCache", "ShaderCache", "DawnCache",
+                                  "DawnGraphiteCache", "DawnWebGPUCache", "Crashpad", "component_crx_cache", NULL };
+const char *CHECKPOINT_CRITICAL[] = { "Cookies", "Login Data", "History", "Bookmarks", "Preferences", "Secure Preferences",
+                                      "Local State", "Web Data", "Sessions", "Current Session", "Current Tabs",
+                                      "Last Session", "Last Tabs", "Notes", "Calendar", "Contacts", NULL };
+
+struct checkpoint {
+    struct sync_ctx sc;
+    struct sync_list crit;
+    long long deadline, walk_end;
+    size_t flushed;
+    unsigned long long copied, copy_us;
+    int cut;
+};
+
+long long monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Critical if the file or its parent directory starts with a listed name, so
+ * SQLite journals ("Cookies-journal") and Sessions/ follow their database */
+int checkpoint_critical(const char *rel) {
+    const char *base = strrchr(rel, '/'), *parent = rel;
+    base = base ? base + 1 : rel;
+    for (const char *p = rel; p < base - 1; p++) if (*p == '/') parent = p + 1;
+    for (int i = 0; CHECKPOINT_CRITICAL[i]; i++) {
+        size_t len = strlen(CHECKPOINT_CRITICAL[i]);
+        if (strncmp(base, CHECKPOINT_CRITICAL[i], len) == 0) return 1;
+        if (parent != base && strncmp(parent, CHECKPOINT_CRITICAL[i], len) == 0 && parent[len] == '/') return 1;
+    }
+    return 0;
+}
+
+int checkpoint_skipped(const char *name) {
+    for (int i = 0; CHECKPOINT_SKIP[i]; i++) if (strcmp(name, CHECKPOINT_SKIP[i]) == 0) return 1;
+    return 0;
+}
+
+/* SQLite keeps uncommitted or not yet checkpointed pages next to the database */
+const char *CHECKPOINT_SQLITE[] = { "", "-journal", "-wal", NULL };
+
+/* Length of the database name if rel is a "-journal"/"-wal" file, else 0 */
+size_t checkpoint_companion(const char *rel) {
+    size_t len = strlen(rel);
+    for (int i = 1; CHECKPOINT_SQLITE[i]; i++) {
+        size_t n = strlen(CHECKPOINT_SQLITE[i]);
+        if (len > n && strcmp(rel + len - n, CHECKPOINT_SQLITE[i]) == 0) return len - n;
+    }
+    return 0;
+}
+
+int checkpoint_stat(struct checkpoint *cp, const char *rel, struct statx *stx) {
+    return statx(cp->sc.src_fd, rel, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_ATIME | STATX_MTIME | STATX_CTIME, stx) == 0;
+}
+
+/* Adds rel to l if it is missing or stale on disk; verified marks critical files.
+ * A journal or WAL is never flushed on its own: it adds its database instead,
+ * which checkpoint_copy() copies together with it. */
+void checkpoint_add(struct checkpoint *cp, struct sync_list *l, const char *rel, const struct statx *stx, int critical) {
+    struct stat st;
+    char db[PATH_BUFFER_MAX];
+    struct statx dbx;
+    size_t n = checkpoint_companion(rel);
+    mode_t m = stx->stx_mode;
+    if (!S_ISDIR(m) && !S_ISLNK(m) && !S_ISREG(m)) return;
+    int exists = fstatat(cp->sc.dst_fd, rel, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    if (S_ISDIR(m) ? exists : S_ISLNK(m) ? exists && S_ISLNK(st.st_mode) :
+        exists && S_ISREG(st.st_mode) && st.st_size == (off_t)stx->stx_size &&
+        st.st_mtim.tv_sec == stx->stx_mtime.tv_sec && st.st_mtim.tv_nsec == (long)stx->stx_mtime.tv_nsec) return;
+    if (S_ISREG(m) && n) {
+        snprintf(db, sizeof(db), "%.*s", (int)n, rel);
+        if (!checkpoint_stat(cp, db, &dbx) || !S_ISREG(dbx.stx_mode)) return;
+        rel = db; stx = &dbx;
+    }
+    struct sync_entry key = { .rel = (char *)rel };
+    if (l != &cp->crit && cp->crit.n && bsearch(&key, cp->crit.v, cp->crit.n, sizeof(key), sync_entry_cmp)) return;
+    char *copy = strdup(rel);
+    pthread_mutex_lock(&l->lock);
+    struct sync_entry *s = sync_list_add(l);
+    s->rel = copy;
+    s->mode = stx->stx_mode;
+    s->size = stx->stx_size;
+    s->verified = critical;
+    pthread_mutex_unlock(&l->lock);
+}
+
+/* Finds the critical entries without walking the tree: the profile root, each
+ * profile directory below it and the contents of critical directories (Sessions/)
+ * are listed, and only matching names are statx()ed */
+void checkpoint_scan(struct checkpoint *cp, const char *dir, int depth) {
+    int fd = openat(cp->sc.src_fd, dir[0] ? dir : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) { if (fd >= 0) close(fd); return; }
+    struct dirent *de;
+    char rel[PATH_BUFFER_MAX];
+    while ((de = readdir(d)) && monotonic_us() < cp->deadline) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        snprintf(rel, sizeof(rel), "%s%s%s", dir, dir[0] ? "/" : "", de->d_name);
+        int critical = depth == 2 || checkpoint_critical(rel);
+        int profile = depth == 0 && !critical && de->d_type == DT_DIR && !checkpoint_skipped(de->d_name);
+        struct statx stx;
+        if ((!critical && !profile) || statx(cp->sc.src_fd, rel, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, &stx) != 0) continue;
+        checkpoint_add(cp, &cp->crit, rel, &stx, critical);
+        if (S_ISDIR(stx.stx_mode) && depth < 2) checkpoint_scan(cp, rel, critical ? 2 : depth + 1);
+    }
+    closedir(d);
+}
+
+int checkpoint_filter(const struct walk_entry *e, void *ctx) {
+    struct checkpoint *cp = ctx;
+    if (monotonic_us() >= cp->walk_end) { __atomic_store_n(&cp->cut, 1, __ATOMIC_RELAXED); return 0; }
+    return e->type != DT_DIR || !checkpoint_skipped(e->name);
+}
+
+/* Collects dirty entries the critical scan has not already handled */
+void checkpoint_visit(const struct walk_entry *e, void *ctx) {
+    struct checkpoint *cp = ctx;
+    checkpoint_add(cp, &cp->sc.extra, e->rel, e->st, checkpoint_critical(e->rel));
+}
+
+/* A database is added by itself and again through a dirty journal; one entry is kept */
+void checkpoint_unique(struct sync_list *l) {
+    if (l->n) qsort(l->v, l->n, sizeof(*l->v), sync_entry_cmp);
+    size_t j = 0;
+    for (size_t i = 0; i < l->n; i++) {
+        if (j && strcmp(l->v[j - 1].rel, l->v[i].rel) == 0) { l->v[j - 1].verified |= l->v[i].verified; free(l->v[i].rel); }
+        else l->v[j++] = l->v[i];
+    }
+    l->n = j;
+}
+
+/* New directories first (parents before children), then critical files, then smallest first */
+int checkpoint_cmp(const void *a, const void *b) {
+    const struct sync_entry *x = a, *y = b;
+    if (S_ISDIR(x->mode) != S_ISDIR(y->mode)) return S_ISDIR(x->mode) ? -1 : 1;
+    if (S_ISDIR(x->mode)) return strcmp(x->rel, y->rel);
+    if (x->verified != y->verified) return x->verified ? -1 : 1;
+    return x->size < y->size ? -1 : x->size > y->size;
+}
+
+/* Copies a file together with its SQLite journal and WAL, so the disk never
+ * pairs a database with a journal from another moment (the browser is still
+ * running). All parts go to temporary files and are renamed into place only if
+ * none changed during the copy; a journal missing in RAM is removed on disk, as
+ * a stale one would roll the new copy back. While the rollback journal is
+ * non-empty a transaction is open and the unit is left for later.
+ * Returns 0, 1 when left for later, or -1 on error. */
+int checkpoint_copy(struct checkpoint *cp, const struct sync_entry *s) {
+    struct sync_entry part[3];
+    struct statx before[3], after;
+    char rel[3][PATH_MAX], tmp[3][PATH_BUFFER_MAX];
+    int have[3], copy[3], rc = 0;
+    for (int i = 0; CHECKPOINT_SQLITE[i]; i++) {
+        snprintf(rel[i], sizeof(rel[i]), "%s%s", s->rel, CHECKPOINT_SQLITE[i]);
+        snprintf(tmp[i], sizeof(tmp[i]), "%s.vrpm-tmp", rel[i]);
+        have[i] = checkpoint_stat(cp, rel[i], &before[i]) && S_ISREG(before[i].stx_mode);
+        part[i] = (struct sync_entry){ .rel = rel[i], .mode = before[i].stx_mode, .size = before[i].stx_size,
+                                       .atime_ns = (long long)before[i].stx_atime.tv_sec * 1000000000LL + before[i].stx_atime.tv_nsec,
+                                       .mtime_ns = statx_mtime_ns(&before[i]) };
+        struct stat st;
+        copy[i] = have[i] && !(fstatat(cp->sc.dst_fd, rel[i], &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) &&
+                               st.st_size == part[i].size && st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec == part[i].mtime_ns);
+    }
+    if (!have[0]) return -1;
+    if (have[1] && before[1].stx_size > 0) rc = 1;
+    for (int i = 0; i < 3 && rc == 0; i++) if (copy[i]) rc = sync_copy_tmp(&cp->sc, &part[i], tmp[i]);
+    for (int i = 0; i < 3 && rc == 0; i++) {
+        if (have[i] && !(checkpoint_stat(cp, rel[i], &after) && after.stx_size == before[i].stx_size &&
+                         after.stx_ctime.tv_sec == before[i].stx_ctime.tv_sec && after.stx_ctime.tv_nsec == before[i].stx_ctime.tv_nsec)) rc = 1;
+        if (!have[i] && checkpoint_stat(cp, rel[i], &after)) rc = 1;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (rc == 0 && copy[i]) rc = renameat(cp->sc.dst_fd, tmp[i], cp->sc.dst_fd, rel[i]) != 0 ? -1 : 0;
+        else if (rc == 0 && !have[i] && unlinkat(cp->sc.dst_fd, rel[i], 0) != 0 && errno != ENOENT) rc = -1;
+        if (rc != 0 && copy[i]) unlinkat(cp->sc.dst_fd, tmp[i], 0);
+    }
+    if (rc == 1) printf(YELLOW "Checkpoint: %s is being written, left for the next --save.\n" RESET, s->rel);
+    return rc;
+}
+
+/* Copies the entries of l that fit before the deadline. A file is skipped when
+ * its estimated copy time (from the measured rate, or CHECKPOINT_MIN_RATE until
+ * enough has been copied to measure) exceeds the time left. SIGTERM from the
+ * hook's timeout is held during each copy so no *.vrpm-tmp file is left behind. */
+void checkpoint_flush(struct checkpoint *cp, struct sync_list *l) {
+    sigset_t term;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    if (monotonic_us() >= cp->deadline) return;
+    checkpoint_unique(l);
+    if (l->n) qsort(l->v, l->n, sizeof(*l->v), checkpoint_cmp);
+    for (size_t i = 0; i < l->n; i++) {
+        struct sync_entry *s = &l->v[i];
+        long long now = monotonic_us();
+        if (now >= cp->deadline) break;
+        unsigned long long cost = cp->copied >= (1 << 20) ? (unsigned long long)s->size * cp->copy_us / cp->copied
+                                                          : (unsigned long long)s->size * 1000 / CHECKPOINT_MIN_RATE;
+        if (cost > (unsigned long long)(cp->deadline - now)) continue;
+
+        struct statx stx;
+        if (statx(cp->sc.src_fd, s->rel, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_ATIME, &stx) != 0) continue;
+        s->mode = stx.stx_mode; s->size = stx.stx_size;
+        s->atime_ns = (long long)stx.stx_atime.tv_sec * 1000000000LL + stx.stx_atime.tv_nsec;
+        s->mtime_ns = statx_mtime_ns(&stx);
+        int rc;
+        pthread_sigmask(SIG_BLOCK, &term, NULL);
+        if (S_ISDIR(stx.stx_mode)) rc = mkdirat(cp->sc.dst_fd, s->rel, stx.stx_mode & 07777) != 0 && errno != EEXIST ? -1 : 0;
+        else if (S_ISLNK(stx.stx_mode)) rc = sync_copy_link(&cp->sc, s);
+        else rc = checkpoint_copy(cp, s);
+        pthread_sigmask(SIG_UNBLOCK, &term, NULL);
+        if (rc != 0) continue;
+        cp->flushed++;
+        cp->copied += stx.stx_size + 1;
+        cp->copy_us += monotonic_us() - now;
+    }
+}
+
+/* Returns the number of dirty entries left unflushed (budget or errors), or -1.
+ * A quarter of the budget is kept for syncfs(). */
+int checkpoint_tree(const char *src, const char *dst, long long budget_ms) {
+    long long start = monotonic_us();
+    struct checkpoint cp = { .sc.label = "Checkpoint", .deadline = start + budget_ms * 1000 * 3 / 4 };
+    cp.sc.src_fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    cp.sc.dst_fd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cp.sc.src_fd < 0 || cp.sc.dst_fd < 0) {
+        if (cp.sc.src_fd >= 0) close(cp.sc.src_fd);
+        if (cp.sc.dst_fd >= 0) close(cp.sc.dst_fd);
+        return -1;
+    }
+    pthread_mutex_init(&cp.crit.lock, NULL);
+    pthread_mutex_init(&cp.sc.extra.lock, NULL);
+
+    checkpoint_scan(&cp, "", 0);
+    checkpoint_flush(&cp, &cp.crit);
+
+    /* The walk gets half of the time left so the entries it finds can still be
+     * copied; the critical list is sorted by name again so checkpoint_visit can
+     * skip what was already handled */
+    long long now = monotonic_us();
+    if (now < cp.deadline) {
+        cp.walk_end = now + (cp.deadline - now) / 2;
+        if (cp.crit.n) qsort(cp.crit.v, cp.crit.n, sizeof(*cp.crit.v), sync_entry_cmp);
+        walk_tree(src, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, checkpoint_filter, checkpoint_visit, &cp, 0);
+        checkpoint_flush(&cp, &cp.sc.extra);
+    } else {
+        cp.cut = 1;
+    }
+    syncfs(cp.sc.dst_fd);
+
+    size_t dirty = cp.crit.n + cp.sc.extra.n;
+    printf("Checkpoint: flushed %zu of %zu dirty entries in %lld ms%s.\n", cp.flushed, dirty, (monotonic_us() - start) / 1000,
+           cp.cut ? " (time ran out before the whole profile was scanned)" : "");
+    pthread_mutex_destroy(&cp.crit.lock);
+    pthread_mutex_destroy(&cp.sc.extra.lock);
+    sync_list_free(&cp.crit);
+    sync_list_free(&cp.sc.extra);
+    close(cp.sc.src_fd); close(cp.sc.dst_fd);
+    return (int)(dirty - cp.flushed);
+}
+
+/* The hook runs as root: a private mount namespace hides the bind mount so the
+ * disk copy is reachable without disturbing the session, then root is dropped
+ * in favour of the profile owner before anything is written */
+int handle_checkpoint() {
+    if (geteuid() != 0) { printf(RED "Error: --checkpoint is run as root by the system-sleep hook.\n" RESET); return 1; }
+    struct stat ram, disk;
+    if (lstat(PROFILE_RAM, &ram) != 0 || !S_ISDIR(ram.st_mode) || !is_mounted()) return 0;
+
+    if (unshare(CLONE_NEWNS) != 0 || mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0 ||
+        umount2(PROFILE_SRC, MNT_DETACH) != 0) {
+        printf(RED "Error: Could not reach the disk copy of the profile.\n" RESET);
+        return 1;
+    }
+    if (lstat(PROFILE_SRC, &disk) != 0 || !S_ISDIR(disk.st_mode) || disk.st_uid != ram.st_uid || ram.st_uid == 0) {
+        printf(RED "Error: RAM and disk profiles have different owners.\n" RESET);
+        return 1;
+    }
+    if (setgroups(0, NULL) != 0 || setgid(ram.st_gid) != 0 || setuid(ram.st_uid) != 0) {
+        printf(RED "Error: Could not drop privileges.\n" RESET);
+        return 1;
+    }
+    return checkpoint_tree(PROFILE_RAM, PROFILE_SRC, CHECKPOINT_BUDGET_MS) < 0;
+}
+
+/* --------------------------------------------------
+ * Backup Encryption
+ * -------------------------------------------------- */
+
+/* Encrypted backups wrap the whole archive stream, names included:
+ *   header: "VRPMAES1" | 16-byte salt | chunk size (u32 LE)
+ *   chunks: AES-256-GCM ciphertext + 16-byte tag, one per ARCHIVE_BUF of plaintext
+ * The per-backup key is HMAC-SHA256(master key, salt) and the nonce is the chunk
+ * counter. Every chunk authenticates the header, its index and whether it is
+ * the last one, so reordering or truncating the stream is detected. */
+
+#define CRYPT_MAGIC "VRPMAES1"
+#define CRYPT_SALT 16
+#define CRYPT_HEADER (8 + CRYPT_SALT + 4)
+#define CRYPT_TAG 16
+
+struct backup_cipher {
+    EVP_CIPHER_CTX *ctx;
+    unsigned char key[32];
+    unsigned char header[CRYPT_HEADER];
+    uint64_t counter;
+    uint32_t chunk;
+    unsigned char *buf;
+};
+
+/* The master key is SHA-256 of a keyfile or of a "user" key in the kernel keyring */
+int load_backup_key(const char *keyfile, const char *keyring_desc, unsigned char key[32]) {
+    unsigned char data[4096];
+    long len = -1;
+    if (keyfile) {
+        FILE *f = fopen(keyfile, "rb");
+        if (!f) { fprintf(stderr, RED "Error: Could not read key file %s\n" RESET, keyfile); return -1; }
+        len = fread(data, 1, sizeof(data), f);
+        fclose(f);
+    } else {
+        long id = syscall(SYS_request_key, "user", keyring_desc, NULL, 0);
+        if (id >= 0) len = syscall(SYS_keyctl, KEYCTL_READ, id, data, sizeof(data));
+        if (len > (long)sizeof(data)) len = sizeof(data);
+        if (len < 0) { fprintf(stderr, RED "Error: Key '%s' not found in the kernel keyring.\n" RESET, keyring_desc); return -1; }
+    }
+    if (len < 16) { fprintf(stderr, RED "Error: Backup key must hold at least 16 bytes.\n" RESET); OPENSSL_cleanse(data, sizeof(data)); return -1; }
+    SHA256(data, len, key);
+    OPENSSL_cleanse(data, sizeof(data));
+    return 0;
+}
+
+int cipher_init(struct backup_cipher *bc, const unsigned char master[32], const unsigned char header[CRYPT_HEADER]) {
+    unsigned int klen = 0;
+    memcpy(bc->header, header, CRYPT_HEADER);
+    bc->counter = 0;
+    bc->chunk = header[24] | header[25] << 8 | header[26] << 16 | (uint32_t)header[27] << 24;
+    if (bc->chunk == 0 || bc->chunk > ARCHIVE_BUF) return -1;
+    bc->ctx = EVP_CIPHER_CTX_new();
+    bc->buf = malloc(ARCHIVE_BUF + CRYPT_TAG);
+    if (!bc->ctx || !bc->buf || !HMAC(EVP_sha256(), master, 32, header + 8, CRYPT_SALT, bc->key, &klen)) return -1;
+    return EVP_CipherInit_ex(bc->ctx, EVP_aes_256_gcm(), NULL, NULL, NULL, -1) == 1 ? 0 : -1;
+}
+
+void cipher_free(struct backup_cipher *bc) {
+    if (bc->ctx) EVP_CIPHER_CTX_free(bc->ctx);
+    free(bc->buf);
+    OPENSSL_cleanse(bc->key, sizeof(bc->key));
+}
+
+/* Seals (encrypt) or opens one chunk into out. Sealing appends the tag; when
+ * opening, len includes the tag and a failed check returns -1. */
+int cipher_chunk(struct backup_cipher *bc, int encrypt, const unsigned char *in, size_t len, int final,
+                 unsigned char *out, size_t *out_len) {
+    unsigned char iv[12] = {0}, aad[CRYPT_HEADER + 9];
+    int n = 0, m = 0;
+    if (!encrypt) { if (len < CRYPT_TAG) return -1; len -= CRYPT_TAG; }
+    memcpy(aad, bc->header, CRYPT_HEADER);
+    for (int i = 0; i < 8; i++) iv[4 + i] = aad[CRYPT_HEADER + i] = bc->counter >> (56 - 8 * i);
+    aad[CRYPT_HEADER + 8] = final;
+    if (EVP_CipherInit_ex(bc->ctx, NULL, NULL, bc->key, iv, encrypt) != 1 ||
+        EVP_CipherUpdate(bc->ctx, NULL, &n, aad, sizeof(aad)) != 1 ||
+        EVP_CipherUpdate(bc->ctx, out, &n, in, len) != 1) return -1;
+    if (!encrypt && EVP_CIPHER_CTX_ctrl(bc->ctx, EVP_CTRL_GCM_SET_TAG, CRYPT_TAG, (void *)(in + len)) != 1) return -1;
+    if (EVP_CipherFinal_ex(bc->ctx, out + n, &m) != 1) return -1;
+    if (encrypt && EVP_CIPHER_CTX_ctrl(bc->ctx, EVP_CTRL_GCM_GET_TAG, CRYPT_TAG, out + n + m) != 1) return -1;
+    bc->counter++;
+    *out_len = n + m + (encrypt ? CRYPT_TAG : 0);
+    return 0;
+}
+
+int write_all(int fd, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+ssize_t read_full(int fd, void *data, size_t len) {
+    unsigned char *p = data;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, p + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+int is_encrypted_backup(const char *path) {
+    char magic[8];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t n = read_full(fd, magic, sizeof(magic));
+    close(fd);
+    return n == (ssize_t)sizeof(magic) && memcmp(magic, CRYPT_MAGIC, 8) == 0;
+}
+
+/* --------------------------------------------------
+ * Backup Archive
+ * -------------------------------------------------- */
+
+/* Backups are written as a streaming ZIP64 archive: every local header carries
+ * the Unix mode (ASi extra field) and mtime, file data is followed by a data
+ * descriptor, and the central directory at the end serves as the index for
+ * random access. This needs no seeking, so the same writer can target a file
+ * in BACKUP_DIR or a pipe, and the reader can restore from a pipe. */
+
+#define ZIP_SIG_LOCAL   0x04034b50
+#define ZIP_SIG_DESC    0x08074b50
+#define ZIP_SIG_CENTRAL 0x02014b50
+#define ZIP_SIG_END64   0x06064b50
+#define ZIP_SIG_LOC64   0x07064b50
+#define ZIP_SIG_END     0x06054b50
+#define ZIP_FLAG_DESC   0x0008
+#define ZIP_FLAG_UTF8   0x0800
+#define ZIP_EXTRA_ZIP64 0x0001
+#define ZIP_EXTRA_TIME  0x5455
+#define ZIP_EXTRA_ASI   0x756e
+#define ZIP_MAX32       0xffffffffULL
+
+void put16(unsigned char **p, uint16_t v) { (*p)[0] = v; (*p)[1] = v >> 8; *p += 2; }
+void put32(unsigned char **p, uint32_t v) { put16(p, v); put16(p, v >> 16); }
+void put64(unsigned char **p, uint64_t v) { put32(p, v); put32(p, v >> 32); }
+uint16_t get16(const unsigned char *p) { return p[0] | p[1] << 8; }
+uint32_t get32(const unsigned char *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+uint64_t get64(const unsigned char *p) { return get32(p) | (uint64_t)get32(p + 4) << 32; }
+
+struct archive_entry {
+    char *name;
+    mode_t mode;
+    time_t mtime;
+    uint16_t flags, method;
+    uint32_t crc;
+    uint64_t csize, usize, offset;
+};
+
+struct archive_writer {
+    int fd;
+    uint64_t offset;
+    int failed, shown;
+    unsigned long long done, total;
+    unsigned char *out;
+    size_t used;
+    struct backup_cipher *cipher;
+    struct archive_entry *v;
+    size_t n, cap;
+};
+
+/* Only the last flush may be short, which is what marks the final encrypted chunk */
+void aw_flush(struct archive_writer *aw, int final) {
+    const unsigned char *data = aw->out;
+    size_t len = aw->used;
+    if (aw->cipher) {
+        if (cipher_chunk(aw->cipher, 1, aw->out, aw->used, final, aw->cipher->buf, &len) != 0) aw->failed = 1;
+        data = aw->cipher->buf;
+    }
+    if (!aw->failed && write_all(aw->fd, data, len) != 0) aw->failed = 1;
+    aw->used = 0;
+}
+
+void aw_write(struct archive_writer *aw, const void *data, size_t len) {
+    const unsigned char *p = data;
+    aw->offset += len;
+    while (len > 0) {
+        size_t n = ARCHIVE_BUF - aw->used < len ? ARCHIVE_BUF - aw->used : len;
+        memcpy(aw->out + aw->used, p, n);
+        aw->used += n; p += n; len -= n;
+        if (aw->used == ARCHIVE_BUF) aw_flush(aw, 0);
+    }
+}
+
+void dos_time(time_t t, uint16_t *dtime, uint16_t *ddate) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    if (tm.tm_year < 80) { *dtime = 0; *ddate = (1 << 5) | 1; return; }
+    *dtime = tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+    *ddate = (tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday;
+}
+
+struct archive_entry *aw_begin(struct archive_writer *aw, const char *name, mode_t mode, time_t mtime,
+                               uint16_t method, uint32_t crc, uint64_t size) {
+    if (aw->n == aw->cap) {
+        aw->cap = aw->cap ? aw->cap * 2 : 1024;
+        aw->v = realloc(aw->v, aw->cap * sizeof(*aw->v));
+        if (!aw->v) { fprintf(stderr, RED "Error: Out of memory.\n" RESET); exit(1); }
+    }
+    struct archive_entry *e = &aw->v[aw->n++];
+    int streamed = S_ISREG(mode);
+    *e = (struct archive_entry){ strdup(name), mode, mtime, ZIP_FLAG_UTF8 | (streamed ? ZIP_FLAG_DESC : 0),
+                                 method, crc, size, size, aw->offset };
+
+    size_t nlen = strlen(name);
+    unsigned char hdr[30 + 20 + 9 + 18], *p = hdr, *asi;
+    uint16_t dtime, ddate;
+    dos_time(mtime, &dtime, &ddate);
+    put32(&p, ZIP_SIG_LOCAL); put16(&p, 45); put16(&p, e->flags); put16(&p, method);
+    put16(&p, dtime); put16(&p, ddate);
+    put32(&p, streamed ? 0 : crc); put32(&p, streamed ? ZIP_MAX32 : size); put32(&p, streamed ? ZIP_MAX32 : size);
+    put16(&p, nlen); put16(&p, (streamed ? 20 : 0) + 9 + 18);
+    unsigned char *extra = p;
+    if (streamed) { put16(&p, ZIP_EXTRA_ZIP64); put16(&p, 16); put64(&p, 0); put64(&p, 0); }
+    put16(&p, ZIP_EXTRA_TIME); put16(&p, 5); *p++ = 1; put32(&p, (uint32_t)mtime);
+    put16(&p, ZIP_EXTRA_ASI); put16(&p, 14); asi = p; put32(&p, 0);
+    put16(&p, mode); put32(&p, 0); put16(&p, 0); put16(&p, 0);
+    unsigned char *crcp = asi;
+    put32(&crcp, crc32(0, asi + 4, 10));
+    aw_write(aw, hdr, 30);
+    aw_write(aw, name, nlen);
+    aw_write(aw, extra, p - extra);
+    return e;
+}
+
+/* Directories and symlinks are small and known up front, so they are stored
+ * with their sizes in the local header. */
+void aw_add_stored(struct archive_writer *aw, const char *name, mode_t mode, time_t mtime, const void *data, size_t len) {
+    aw_begin(aw, name, mode, mtime, 0, crc32(0, data, len), len);
+    aw_write(aw, data, len);
+}
+
+int aw_add_file(struct archive_writer *aw, const char *name, int in, mode_t mode, time_t mtime) {
+    struct archive_entry *e = aw_begin(aw, name, mode, mtime, 8, 0, 0);
+    size_t idx = e - aw->v;
+    unsigned char *ibuf = malloc(ARCHIVE_BUF), *obuf = malloc(ARCHIVE_BUF);
+    z_stream z = {0};
+    int rc = (ibuf && obuf && deflateInit2(&z, BACKUP_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK) ? 0 : -1;
+    uint32_t crc = crc32(0, NULL, 0);
+    uint64_t usize = 0, csize = 0;
+    int flush = Z_NO_FLUSH;
+    while (rc == 0 && flush != Z_FINISH) {
+        ssize_t n = read(in, ibuf, ARCHIVE_BUF);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { rc = -1; break; }
+        if (n == 0) flush = Z_FINISH;
+        crc = crc32(crc, ibuf, n);
+        usize += n;
+        z.next_in = ibuf; z.avail_in = n;
+        do {
+            z.next_out = obuf; z.avail_out = ARCHIVE_BUF;
+            deflate(&z, flush);
+            aw_write(aw, obuf, ARCHIVE_BUF - z.avail_out);
+            csize += ARCHIVE_BUF - z.avail_out;
+        } while (z.avail_out == 0);
+        aw->done += n;
+        int permille = (int)(aw->done * 1000 / (aw->total ? aw->total : 1));
+        if (permille != aw->shown) { aw->shown = permille; print_progress("Backing up", permille / 1000.0); }
+    }
+    deflateEnd(&z);
+    free(ibuf); free(obuf);
+
+    /* The entry stays in the archive either way; a short read leaves it truncated but well-formed */
+    e = &aw->v[idx];
+    e->crc = crc; e->usize = usize; e->csize = csize;
+    unsigned char desc[24], *p = desc;
+    put32(&p, ZIP_SIG_DESC); put32(&p, crc); put64(&p, csize); put64(&p, usize);
+    aw_write(aw, desc, sizeof(desc));
+    return rc;
+}
+
+int aw_finish(struct archive_writer *aw) {
+    uint64_t cd_start = aw->offset;
+    for (size_t i = 0; i < aw->n; i++) {
+        const struct archive_entry *e = &aw->v[i];
+        size_t nlen = strlen(e->name);
+        unsigned char hdr[46 + 28 + 9], *p = hdr;
+        uint16_t dtime, ddate, z64 = 0;
+        dos_time(e->mtime, &dtime, &ddate);
+        if (e->usize >= ZIP_MAX32) z64 += 8;
+        if (e->csize >= ZIP_MAX32) z64 += 8;
+        if (e->offset >= ZIP_MAX32) z64 += 8;
+        put32(&p, ZIP_SIG_CENTRAL); put16(&p, 3 << 8 | 45); put16(&p, 45); put16(&p, e->flags); put16(&p, e->method);
+        put16(&p, dtime); put16(&p, ddate); put32(&p, e->crc);
+        put32(&p, e->csize >= ZIP_MAX32 ? ZIP_MAX32 : e->csize);
+        put32(&p, e->usize >= ZIP_MAX32 ? ZIP_MAX32 : e->usize);
+        put16(&p, nlen); put16(&p, (z64 ? 4 + z64 : 0) + 9); put16(&p, 0);
+        put16(&p, 0); put16(&p, 0); put32(&p, (uint32_t)e->mode << 16);
+        put32(&p, e->offset >= ZIP_MAX32 ? ZIP_MAX32 : e->offset);
+        unsigned char *extra = p;
+        if (z64) {
+            put16(&p, ZIP_EXTRA_ZIP64); put16(&p, z64);
+            if (e->usize >= ZIP_MAX32) put64(&p, e->usize);
+            if (e->csize >= ZIP_MAX32) put64(&p, e->csize);
+            if (e->offset >= ZIP_MAX32) put64(&p, e->offset);
+        }
+        put16(&p, ZIP_EXTRA_TIME); put16(&p, 5); *p++ = 1; put32(&p, (uint32_t)e->mtime);
+        aw_write(aw, hdr, 46);
+        aw_write(aw, e->name, nlen);
+        aw_write(aw, extra, p - extra);
+    }
+    uint64_t cd_size = aw->offset - cd_start, end64 = aw->offset;
+    unsigned char tail[56 + 20 + 22], *p = tail;
+    if (aw->n >= 0xffff || cd_size >= ZIP_MAX32 || cd_start >= ZIP_MAX32) {
+        put32(&p, ZIP_SIG_END64); put64(&p, 44); put16(&p, 3 << 8 | 45); put16(&p, 45);
+        put32(&p, 0); put32(&p, 0); put64(&p, aw->n); put64(&p, aw->n); put64(&p, cd_size); put64(&p, cd_start);
+        put32(&p, ZIP_SIG_LOC64); put32(&p, 0); put64(&p, end64); put32(&p, 1);
+    }
+    put32(&p, ZIP_SIG_END); put16(&p, 0); put16(&p, 0);
+    put16(&p, aw->n >= 0xffff ? 0xffff : aw->n); put16(&p, aw->n >= 0xffff ? 0xffff : aw->n);
+    put32(&p, cd_size >= ZIP_MAX32 ? ZIP_MAX32 : cd_size); put32(&p, cd_start >= ZIP_MAX32 ? ZIP_MAX32 : cd_start);
+    put16(&p, 0);
+    aw_write(aw, tail, p - tail);
+    aw_flush(aw, 1);
+    return aw->failed ? -1 : 0;
+}
+
+/* Writes the tree below root to fd as a single pass; fd may be a pipe. The
+ * archive is encrypted when key is not NULL. */
+int write_backup(const char *root, int fd, const unsigned char *key) {
+    struct sync_list entries = {0};
+    if (collect_tree(root, NULL, &entries, 0) != 0) { sync_list_free(&entries); return -1; }
+    struct archive_writer aw = { .fd = fd, .out = malloc(ARCHIVE_BUF) };
+    for (size_t i = 0; i < entries.n; i++) if (S_ISREG(entries.v[i].mode)) aw.total += entries.v[i].size;
+    struct backup_cipher bc = {0};
+    if (key) {
+        unsigned char header[CRYPT_HEADER], *p = header + 8 + CRYPT_SALT;
+        memcpy(header, CRYPT_MAGIC, 8);
+        put32(&p, ARCHIVE_BUF);
+        if (RAND_bytes(header + 8, CRYPT_SALT) != 1 || cipher_init(&bc, key, header) != 0 || write_all(fd, header, sizeof(header)) != 0) {
+            free(aw.out); aw.out = NULL;
+        }
+        aw.cipher = &bc;
+    }
+    if (!aw.out) { cipher_free(&bc); sync_list_free(&entries); return -1; }
+    int rc = 0;
+    for (size_t i = 0; i < entries.n && !aw.failed; i++) {
+        const struct sync_entry *e = &entries.v[i];
+        char p[PATH_BUFFER_MAX], name[PATH_BUFFER_MAX];
+        time_t mtime = e->mtime_ns / 1000000000LL;
+        snprintf(p, sizeof(p), "%s/%s", root, e->rel);
+        if (S_ISDIR(e->mode)) {
+            snprintf(name, sizeof(name), "%s/", e->rel);
+            aw_add_stored(&aw, name, e->mode, mtime, NULL, 0);
+        } else if (S_ISLNK(e->mode)) {
+            char target[PATH_MAX];
+            ssize_t n = readlink(p, target, sizeof(target));
+            if (n >= 0) aw_add_stored(&aw, e->rel, e->mode, mtime, target, n);
+        } else if (S_ISREG(e->mode)) {
+            int in = open(p, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (in < 0) { fprintf(stderr, RED "\nWarning: Skipped unreadable %s\n" RESET, e->rel); continue; }
+            if (aw_add_file(&aw, e->rel, in, e->mode, mtime) != 0) {
+                fprintf(stderr, RED "\nError: Could not read %s\n" RESET, e->rel);
+                rc = -1;
+            }
+            close(in);
+        }
+    }
+    if (aw_finish(&aw) != 0) rc = -1;
+    print_progress("Backing up", 1.0);
+    for (size_t i = 0; i < aw.n; i++) free(aw.v[i].name);
+    free(aw.v); free(aw.out);
+    cipher_free(&bc);
+    sync_list_free(&entries);
+    return rc;
+}
+
+/* Rejects absolute names and ".." components so an archive cannot write outside the profile */
+int safe_entry_name(const char *name) {
+    if (!name[0] || name[0] == '/') return 0;
+    for (const char *p = name; *p;) {
+        const char *slash = strchr(p, '/');
+        size_t len = slash ? (size_t)(slash - p) : strlen(p);
+        if (len == 2 && p[0] == '.' && p[1] == '.') return 0;
+        p += len + (slash ? 1 : 0);
+    }
+    return 1;
+}
+
+/* Opens the directory that will hold rel below dest_fd one component at a time
+ * with O_NOFOLLOW, creating missing ones, so no symlink on the way can redirect
+ * the entry. *leaf points at the last component. Returns -1 if a component is
+ * a symlink or cannot be opened. */
+int open_entry_parent(int dest_fd, const char *rel, const char **leaf) {
+    int fd = fcntl(dest_fd, F_DUPFD_CLOEXEC, 0);
+    const char *p = rel, *slash;
+    char part[NAME_MAX + 1];
+    while (fd >= 0 && (slash = strchr(p, '/')) && slash[1]) {
+        size_t len = slash - p;
+        if (len > NAME_MAX) { close(fd); return -1; }
+        memcpy(part, p, len); part[len] = '\0';
+        p = slash + 1;
+        if (len == 0) continue;
+        int next = openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        /* EEXIST: another writer thread created it first */
+        if (next < 0 && errno == ENOENT && (mkdirat(fd, part, 0700) == 0 || errno == EEXIST))
+            next = openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        close(fd);
+        fd = next;
+    }
+    *leaf = p;
+    return fd;
+}
+
+/* Directories and links are applied once every file is written: a link made
+ * early could redirect later entries outside the destination. type is 'd'
+ * (directory), 's' (symlink) or 'h' (hard link, target relative to dest). */
+struct deferred_entry { char type, *rel, *target; mode_t mode; long long mtime_ns; uid_t uid; gid_t gid; };
+struct deferred_list { struct deferred_entry *v; size_t n, cap; };
+
+/* mtime_ns -1 leaves the time alone, uid -1 the owner */
+struct deferred_entry *defer_entry(struct deferred_list *l, char type, const char *rel, const char *target) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 256;
+        l->v = realloc(l->v, l->cap * sizeof(*l->v));
+        if (!l->v) { fprintf(stderr, RED "Error: Out of memory.\n" RESET); exit(1); }
+    }
+    struct deferred_entry *d = &l->v[l->n++];
+    *d = (struct deferred_entry){ type, strdup(rel), target ? strdup(target) : NULL, 0, -1, (uid_t)-1, (gid_t)-1 };
+    return d;
+}
+
+/* Links first, in archive order, then directory attributes deepest first.
+ * Returns the number of entries that could not be applied; frees the list. */
+int apply_deferred(int dest_fd, struct deferred_list *l) {
+    int errors = 0;
+    for (size_t i = 0; i < l->n; i++) {
+        struct deferred_entry *d = &l->v[i];
+        const char *leaf, *tleaf;
+        if (d->type == 'd') continue;
+        int pfd = open_entry_parent(dest_fd, d->rel, &leaf), rc = -1;
+        if (pfd >= 0) {
+            unlinkat(pfd, leaf, 0);
+            if (d->type == 's') rc = symlinkat(d->target, pfd, leaf);
+            else {
+                int tfd = open_entry_parent(dest_fd, d->target, &tleaf);
+                if (tfd >= 0) { rc = linkat(tfd, tleaf, pfd, leaf, 0); close(tfd); }
+            }
+        }
+        if (rc != 0) { printf(RED "\nError: Could not link %s\n" RESET, d->rel); errors++; }
+        else if (d->type == 's') {
+            struct timespec ts[2] = { { 0, UTIME_OMIT }, { d->mtime_ns / 1000000000LL, d->mtime_ns % 1000000000LL } };
+            if (geteuid() == 0 && d->uid != (uid_t)-1) fchownat(pfd, leaf, d->uid, d->gid, AT_SYMLINK_NOFOLLOW);
+            if (d->mtime_ns >= 0) utimensat(pfd, leaf, ts, AT_SYMLINK_NOFOLLOW);
+        }
+        if (pfd >= 0) close(pfd);
+    }
+    for (size_t i = l->n; i-- > 0;) {
+        struct deferred_entry *d = &l->v[i];
+        const char *leaf;
+        int pfd = d->type == 'd' ? open_entry_parent(dest_fd, d->rel, &leaf) : -1;
+        int fd = pfd >= 0 ? openat(pfd, leaf, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+        if (fd >= 0) {
+            struct timespec ts[2] = { { 0, UTIME_OMIT }, { d->mtime_ns / 1000000000LL, d->mtime_ns % 1000000000LL } };
+            if (geteuid() == 0 && d->uid != (uid_t)-1) fchown(fd, d->uid, d->gid);
+            fchmod(fd, d->mode & 07777);
+            if (d->mtime_ns >= 0) futimens(fd, ts);
+            close(fd);
+        }
+        if (pfd >= 0) close(pfd);
+        free(d->rel); free(d->target);
+    }
+    free(l->v);
+    l->v = NULL; l->n = l->cap = 0;
+    return errors;
+}
+
+struct archive_reader {
+    int fd;
+    unsigned char *buf, *raw;
+    size_t pos, len;
+    int eof;
+    struct backup_cipher *cipher;
+};
+
+int ar_fill(struct archive_reader *ar) {
+    if (ar->pos < ar->len) return 1;
+    if (ar->eof) return 0;
+    if (ar->cipher) {
+        size_t want = ar->cipher->chunk + CRYPT_TAG, len = 0;
+        ssize_t n = read_full(ar->fd, ar->raw, want);
+        int final = n >= 0 && (size_t)n < want;
+        ar->pos = 0;
+        ar->len = 0;
+        if (final) ar->eof = 1;
+        if (n < 0 || cipher_chunk(ar->cipher, 0, ar->raw, n, final, ar->buf, &len) != 0) {
+            fprintf(stderr, RED "\nError: Backup failed authentication (wrong key, truncated or corrupt).\n" RESET);
+            ar->eof = 1;
+            return 0;
+        }
+        ar->len = len;
+        return len > 0;
+    }
+    ssize_t n;
+    do { n = read(ar->fd, ar->buf, ARCHIVE_BUF); } while (n < 0 && errno == EINTR);
+    ar->pos = 0;
+    ar->len = n > 0 ? n : 0;
+    if (n <= 0) ar->eof = 1;
+    return n > 0;
+}
+
+int ar_read(struct archive_reader *ar, void *dst, size_t len) {
+    unsigned char *d = dst;
+    while (len > 0) {
+        if (!ar_fill(ar)) return -1;
+        size_t n = ar->len - ar->pos < len ? ar->len - ar->pos : len;
+        if (d) { memcpy(d, ar->buf + ar->pos, n); d += n; }
+        ar->pos += n; len -= n;
+    }
+    return 0;
+}
+
+/* Streams entry data to out (or discards it when out < 0) and returns its CRC */
+int ar_extract(struct archive_reader *ar, uint16_t method, uint64_t csize, int out, uint32_t *crc, uint64_t *written) {
+    unsigned char *obuf = malloc(ARCHIVE_BUF);
+    if (!obuf) return -1;
+    int rc = 0;
+    *crc = crc32(0, NULL, 0);
+    *written = 0;
+    if (method == 0) {
+        while (rc == 0 && csize > 0) {
+            if (!ar_fill(ar)) { rc = -1; break; }
+            size_t n = ar->len - ar->pos < csize ? ar->len - ar->pos : csize;
+            *crc = crc32(*crc, ar->buf + ar->pos, n);
+            if (out >= 0 && write(out, ar->buf + ar->pos, n) != (ssize_t)n) rc = -1;
+            ar->pos += n; csize -= n; *written += n;
+        }
+    } else {
+        z_stream z = {0};
+        int zr = inflateInit2(&z, -15) == Z_OK ? Z_OK : Z_DATA_ERROR;
+        while (zr == Z_OK) {
+            if (!ar_fill(ar)) { zr = Z_DATA_ERROR; break; }
+            z.next_in = ar->buf + ar->pos; z.avail_in = ar->len - ar->pos;
+            z.next_out = obuf; z.avail_out = ARCHIVE_BUF;
+            zr = inflate(&z, Z_NO_FLUSH);
+            if (zr == Z_BUF_ERROR) zr = Z_OK;
+            size_t n = ARCHIVE_BUF - z.avail_out;
+            ar->pos = ar->len - z.avail_in;
+            *crc = crc32(*crc, obuf, n);
+            *written += n;
+            if (out >= 0 && n > 0 && write(out, obuf, n) != (ssize_t)n) zr = Z_ERRNO;
+        }
+        inflateEnd(&z);
+        if (zr != Z_STREAM_END) rc = -1;
+    }
+    free(obuf);
+    return rc;
+}
+
+/* --------------------------------------------------
+ * Legacy Backups
+ * -------------------------------------------------- */
+
+/* Backups made by the old shell pipeline (`tar -cf - . | zip -q -9 out.zip -`)
+ * hold a single ZIP entry named "-" containing a tar stream. The entry is
+ * inflated (by libzip, or from a backup stream on stdin) and parsed as tar on
+ * the fly; small files are handed to writer threads through a bounded queue
+ * while large ones are written by the decoder itself, so the tar never
+ * touches the disk. */
+
+struct legacy_job {
+    char *rel;
+    unsigned char *data;
+    size_t size;
+    mode_t mode;
+    long long mtime_ns;
+    uid_t uid;
+    gid_t gid;
+    struct legacy_job *next;
+};
+
+struct legacy_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty, space;
+    struct legacy_job *head, *tail;
+    size_t bytes;
+    int dest_fd, done, errors;
+};
+
+/* Entry data comes from libzip (zf) or straight from a backup stream (ar),
+ * in which case it is inflated here and its CRC tracked for the descriptor */
+struct legacy_reader {
+    zip_file_t *zf;
+    struct archive_reader *ar;
+    z_stream z;
+    uint16_t method;
+    uint64_t left;
+    uint32_t crc;
+    int ended, shown;
+    unsigned long long total, processed;
+};
+
+/* Returns the number of bytes produced, 0 at the end of the entry, -1 on error */
+zip_int64_t legacy_pull(struct legacy_reader *lr, unsigned char *d, size_t len) {
+    if (lr->zf) return zip_fread(lr->zf, d, len);
+    struct archive_reader *ar = lr->ar;
+    if (lr->ended) return 0;
+    size_t n;
+    if (lr->method == 0) {
+        if (lr->left == 0) { lr->ended = 1; return 0; }
+        if (!ar_fill(ar)) return -1;
+        n = ar->len - ar->pos;
+        if (n > len) n = len;
+        if (n > lr->left) n = lr->left;
+        memcpy(d, ar->buf + ar->pos, n);
+        ar->pos += n; lr->left -= n;
+    } else {
+        lr->z.next_out = d; lr->z.avail_out = len;
+        while (lr->z.avail_out == len) {
+            if (!ar_fill(ar)) return -1;
+            lr->z.next_in = ar->buf + ar->pos; lr->z.avail_in = ar->len - ar->pos;
+            int zr = inflate(&lr->z, Z_NO_FLUSH);
+            ar->pos = ar->len - lr->z.avail_in;
+            if (zr == Z_STREAM_END) { lr->ended = 1; break; }
+            if (zr != Z_OK && zr != Z_BUF_ERROR) return -1;
+        }
+        n = len - lr->z.avail_out;
+    }
+    lr->crc = crc32(lr->crc, d, n);
+    return n;
+}
+
+int legacy_read(struct legacy_reader *lr, void *dst, size_t len) {
+    unsigned char *d = dst;
+    while (len > 0) {
+        zip_int64_t n = legacy_pull(lr, d, len);
+        if (n <= 0) return -1;
+        d += n; len -= n;
+        lr->processed += n;
+        if (lr->total) {
+            int permille = (int)(lr->processed * 1000 / lr->total);
+            if (permille != lr->shown) { lr->shown = permille; print_progress("Restoring", permille / 1000.0); }
+        } else if (lr->processed >> 20 != (lr->processed - n) >> 20) {
+            printf("\rRestoring: %.2f MB", (double)lr->processed / (1024 * 1024));
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
+
+int legacy_skip(struct legacy_reader *lr, uint64_t len) {
+    unsigned char buf[8192];
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (legacy_read(lr, buf, n) != 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Numeric tar fields are octal, or base-256 when the high bit is set (GNU) */
+uint64_t tar_number(const char *field, size_t len) {
+    const unsigned char *p = (const unsigned char *)field;
+    uint64_t v = 0;
+    if (p[0] & 0x80) {
+        v = p[0] & 0x7f;
+        for (size_t i = 1; i < len; i++) v = v << 8 | p[i];
+        return v;
+    }
+    while (len && (*p == ' ' || *p == '\0')) p++, len--;
+    for (size_t i = 0; i < len && p[i] >= '0' && p[i] <= '7'; i++) v = v << 3 | (p[i] - '0');
+    return v;
+}
+
+int tar_checksum_ok(const unsigned char *h) {
+    uint64_t sum = 0;
+    for (int i = 0; i < 512; i++) sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    return sum == tar_number((const char *)h + 148, 8);
+}
+
+/* Creates rel below dest_fd without following symlinks anywhere on the path */
+int legacy_create(int dest_fd, const char *rel) {
+    const char *leaf;
+    int pfd = open_entry_parent(dest_fd, rel, &leaf);
+    if (pfd < 0) return -1;
+    unlinkat(pfd, leaf, 0);
+    int fd = openat(pfd, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    close(pfd);
+    return fd;
+}
+
+int legacy_close(int fd, mode_t mode, long long mtime_ns, uid_t uid, gid_t gid) {
+    struct timespec ts[2] = { { 0, UTIME_OMIT }, { mtime_ns / 1000000000LL, mtime_ns % 1000000000LL } };
+    if (geteuid() == 0) fchown(fd, uid, gid);
+    fchmod(fd, mode & 07777);
+    futimens(fd, ts);
+    return close(fd);
+}
+
+void *legacy_writer(void *arg) {
+    struct legacy_queue *q = arg;
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (!q->head && !q->done) pthread_cond_wait(&q->nonempty, &q->lock);
+        struct legacy_job *job = q->head;
+        if (job) { q->head = job->next; if (!q->head) q->tail = NULL; }
+        pthread_mutex_unlock(&q->lock);
+        if (!job) break;
+
+        int fd = legacy_create(q->dest_fd, job->rel), rc = fd < 0 ? -1 : write_all(fd, job->data, job->size);
+        if (fd >= 0 && legacy_close(fd, job->mode, job->mtime_ns, job->uid, job->gid) != 0) rc = -1;
+        if (rc != 0) fprintf(stderr, RED "\nError: Could not write %s\n" RESET, job->rel);
+
+        pthread_mutex_lock(&q->lock);
+        q->bytes -= job->size;
+        if (rc != 0) q->errors++;
+        pthread_cond_signal(&q->space);
+        pthread_mutex_unlock(&q->lock);
+        free(job->rel); free(job->data); free(job);
+    }
+    return NULL;
+}
+
+void legacy_enqueue(struct legacy_queue *q, struct legacy_job *job) {
+    pthread_mutex_lock(&q->lock);
+    while (q->bytes > 0 && q->bytes + job->size > LEGACY_QUEUE_BYTES) pthread_cond_wait(&q->space, &q->lock);
+    if (q->tail) q->tail->next = job; else q->head = job;
+    q->tail = job;
+    q->bytes += job->size;
+    pthread_cond_signal(&q->nonempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Streams a large file straight from the decoder to disk; -2 means the archive itself failed */
+int legacy_write_inline(struct legacy_reader *lr, int dest_fd, const char *rel, uint64_t size, mode_t mode, long long mtime_ns, uid_t uid, gid_t gid) {
+    unsigned char *buf = malloc(ARCHIVE_BUF);
+    int fd = buf ? legacy_create(dest_fd, rel) : -1;
+    int rc = fd < 0 ? -1 : 0;
+    while (size > 0) {
+        size_t n = size < ARCHIVE_BUF ? size : ARCHIVE_BUF;
+        if (!buf || legacy_read(lr, buf, n) != 0) { free(buf); if (fd >= 0) close(fd); return -2; }
+        if (rc == 0 && write_all(fd, buf, n) != 0) rc = -1;
+        size -= n;
+    }
+    if (fd >= 0 && legacy_close(fd, mode, mtime_ns, uid, gid) != 0) rc = -1;
+    free(buf);
+    return rc;
+}
+
+/* pax times are decimal seconds with an optional fraction */
+long long pax_time_ns(const char *v) {
+    char *end;
+    long long ns = strtoll(v, &end, 10) * 1000000000LL;
+    if (*end == '.') {
+        long long scale = 100000000LL;
+        for (const char *p = end + 1; *p >= '0' && *p <= '9' && scale > 0; p++, scale /= 10) ns += (*p - '0') * scale;
+    }
+    return ns;
+}
+
+/* Strips leading "./" so GNU tar names map onto the profile root */
+const char *tar_relative(const char *name) {
+    while (name[0] == '.' && name[1] == '/') name += 2;
+    while (name[0] == '/') name++;
+    return name;
+}
+
+/* Returns the number of errors; truncation or a bad header stops the restore.
+ * The tar's end-of-archive padding is left unread in lr. */
+int restore_legacy_tar(struct legacy_reader *lr, const char *dest) {
+    int dest_fd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dest_fd < 0) { printf(RED "Error: Could not open %s\n" RESET, dest); return 1; }
+
+    struct legacy_queue q = { .dest_fd = dest_fd };
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.nonempty, NULL);
+    pthread_cond_init(&q.space, NULL);
+    int nthreads = walk_threads(0), started = 0;
+    pthread_t tids[WALK_MAX_THREADS];
+    for (int i = 0; i < nthreads; i++) if (pthread_create(&tids[started], NULL, legacy_writer, &q) == 0) started++;
+
+    struct deferred_list deferred = {0};
+    char long_name[PATH_BUFFER_MAX] = "", long_link[PATH_BUFFER_MAX] = "";
+    char name[PATH_BUFFER_MAX], link_target[PATH_BUFFER_MAX];
+    unsigned char h[512];
+    long long pax_mtime_ns = -1;
+    int errors = 0, files = 0, truncated = 0;
+
+    for (;;) {
+        if (legacy_read(lr, h, sizeof(h)) != 0) { truncated = 1; break; }
+        if (h[0] == '\0') break;
+        if (!tar_checksum_ok(h)) { printf(RED "\nError: Corrupt tar header in legacy backup.\n" RESET); errors++; break; }
+
+        char type = h[156];
+        uint64_t size = tar_number((char *)h + 124, 12), padded = (size + 511) & ~511ULL;
+        mode_t mode = tar_number((char *)h + 100, 8) & 07777;
+        long long mtime_ns = pax_mtime_ns >= 0 ? pax_mtime_ns : (long long)tar_number((char *)h + 136, 12) * 1000000000LL;
+        uid_t uid = tar_number((char *)h + 108, 8);
+        gid_t gid = tar_number((char *)h + 116, 8);
+
+        /* GNU long names and pax records apply to the header that follows */
+        if (type == 'L' || type == 'K' || type == 'x') {
+            char *buf = size < (1 << 20) ? malloc(padded + 1) : NULL;
+            if (!buf || legacy_read(lr, buf, padded) != 0) { free(buf); truncated = 1; break; }
+            buf[size] = '\0';
+            if (type == 'L') snprintf(long_name, sizeof(long_name), "%s", buf);
+            else if (type == 'K') snprintf(long_link, sizeof(long_link), "%s", buf);
+            else {
+                for (char *rec = buf; rec < buf + size;) {
+                    char *end;
+                    long len = strtol(rec, &end, 10);
+                    if (len <= 0 || rec + len > buf + size || *end != ' ') break;
+                    char *kv = end + 1, *nl = rec + len - 1;
+                    *nl = '\0';
+                    if (strncmp(kv, "path=", 5) == 0) snprintf(long_name, sizeof(long_name), "%s", kv + 5);
+                    else if (strncmp(kv, "linkpath=", 9) == 0) snprintf(long_link, sizeof(long_link), "%s", kv + 9);
+                    else if (strncmp(kv, "mtime=", 6) == 0) pax_mtime_ns = pax_time_ns(kv + 6);
+                    rec += len;
+                }
+            }
+            free(buf);
+            continue;
+        }
+
+        if (long_name[0]) snprintf(name, sizeof(name), "%s", long_name);
+        else if (h[345] && memcmp(h + 257, "ustar", 5) == 0) snprintf(name, sizeof(name), "%.155s/%.100s", (char *)h + 345, (char *)h);
+        else snprintf(name, sizeof(name), "%.100s", (char *)h);
+        if (long_link[0]) snprintf(link_target, sizeof(link_target), "%s", long_link);
+        else snprintf(link_target, sizeof(link_target), "%.100s", (char *)h + 157);
+        long_name[0] = long_link[0] = '\0';
+        pax_mtime_ns = -1;
+
+        size_t nlen = strlen(name);
+        while (nlen > 0 && name[nlen - 1] == '/') name[--nlen] = '\0';
+        const char *rel = tar_relative(name);
+        if (!rel[0] || !safe_entry_name(rel)) {
+            if (rel[0]) { printf(RED "\nSkipped unsafe entry: %s\n" RESET, rel); errors++; }
+            if (legacy_skip(lr, padded) != 0) { truncated = 1; break; }
+            continue;
+        }
+
+        if (type == '0' || type == '\0' || type == '7') {
+            if (size <= LEGACY_INLINE_MAX) {
+                struct legacy_job *job = calloc(1, sizeof(*job));
+                unsigned char *data = malloc(padded ? padded : 1);
+                if (!job || !data || legacy_read(lr, data, padded) != 0) { free(job); free(data); truncated = 1; break; }
+                *job = (struct legacy_job){ strdup(rel), data, size, mode, mtime_ns, uid, gid, NULL };
+                legacy_enqueue(&q, job);
+            } else {
+                int rc = legacy_write_inline(lr, dest_fd, rel, size, mode, mtime_ns, uid, gid);
+                if (rc == -2 || legacy_skip(lr, padded - size) != 0) { truncated = 1; break; }
+                if (rc != 0) { printf(RED "\nError: Could not write %s\n" RESET, rel); errors++; }
+            }
+            files++;
+            continue;
+        }
+
+        if (type == '5') {
+            const char *leaf;
+            int pfd = open_entry_parent(dest_fd, rel, &leaf);
+            if (pfd < 0 || (mkdirat(pfd, leaf, 0700) != 0 && errno != EEXIST)) { printf(RED "\nError: Could not create %s\n" RESET, rel); errors++; }
+            if (pfd >= 0) close(pfd);
+        }
+        if (type == '5' || type == '2' || type == '1') {
+            const char *target = type == '1' ? tar_relative(link_target) : link_target;
+            if (type == '1' && !safe_entry_name(target)) { printf(RED "\nSkipped unsafe link: %s\n" RESET, rel); errors++; }
+            else {
+                struct deferred_entry *d = defer_entry(&deferred, type == '5' ? 'd' : type == '2' ? 's' : 'h', rel, type == '5' ? NULL : target);
+                d->mode = mode; d->mtime_ns = mtime_ns; d->uid = uid; d->gid = gid;
+            }
+        }
+        if (legacy_skip(lr, padded) != 0) { truncated = 1; break; }
+    }
+    if (truncated) { printf(RED "\nError: Legacy backup is truncated.\n" RESET); errors++; }
+
+    pthread_mutex_lock(&q.lock);
+    q.done = 1;
+    pthread_cond_broadcast(&q.nonempty);
+    pthread_mutex_unlock(&q.lock);
+    if (started == 0) legacy_writer(&q);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    errors += q.errors;
+    errors += apply_deferred(dest_fd, &deferred);
+
+    close(dest_fd);
+    pthread_cond_destroy(&q.nonempty); pthread_cond_destroy(&q.space); pthread_mutex_destroy(&q.lock);
+    if (lr->total) print_progress("Restoring", 1.0);
+    printf("\nRestored %d files from legacy backup.\n", files);
+    return errors;
+}
+
+/* --------------------------------------------------
+ * Stream Restore
+ * -------------------------------------------------- */
+
+/* Restores an archive produced by write_backup() from a non-seekable fd by
+ * walking the local headers; the central directory is not needed. Encrypted
+ * archives are recognised by their header and need key. An old backup piped
+ * in (a single entry named "-") is restored as a legacy tar. */
+int restore_stream(int fd, const char *dest, const unsigned char *key) {
+    struct archive_reader ar = { .fd = fd, .buf = malloc(ARCHIVE_BUF) };
+    struct backup_cipher bc = {0};
+    unsigned char head[CRYPT_HEADER];
+    if (!ar.buf) return -1;
+    ssize_t got = read_full(fd, head, 8);
+    if (got == 8 && memcmp(head, CRYPT_MAGIC, 8) == 0) {
+        int ok = key != NULL;
+        if (!ok) fprintf(stderr, RED "Error: This backup is encrypted. Pass --keyfile or --keyring.\n" RESET);
+        else if (read_full(fd, head + 8, CRYPT_HEADER - 8) != CRYPT_HEADER - 8 || cipher_init(&bc, key, head) != 0 ||
+                 !(ar.raw = malloc(ARCHIVE_BUF + CRYPT_TAG))) {
+            fprintf(stderr, RED "Error: Unreadable encryption header.\n" RESET);
+            ok = 0;
+        }
+        if (!ok) { cipher_free(&bc); free(ar.buf); return -1; }
+        ar.cipher = &bc;
+    } else if (got > 0) {
+        memcpy(ar.buf, head, got);
+        ar.len = got;
+    }
+    int dest_fd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dest_fd < 0) { fprintf(stderr, RED "Error: Could not open %s\n" RESET, dest); cipher_free(&bc); free(ar.buf); free(ar.raw); return -1; }
+    struct deferred_list deferred = {0};
+    int errors = 0, files = 0;
+    unsigned long long bytes = 0;
+    char name[PATH_BUFFER_MAX];
+    unsigned char hdr[30], extra[65536];
+
+    for (;;) {
+        if (ar_read(&ar, hdr, 4) != 0) { fprintf(stderr, RED "\nError: Archive ends without a central directory.\n" RESET); errors++; break; }
+        uint32_t sig = get32(hdr);
+        if (sig == ZIP_SIG_CENTRAL || sig == ZIP_SIG_END || sig == ZIP_SIG_END64) break;
+        if (sig != ZIP_SIG_LOCAL || ar_read(&ar, hdr + 4, 26) != 0) { fprintf(stderr, RED "\nError: Not a vrpm backup stream.\n" RESET); errors++; break; }
+
+        uint16_t flags = get16(hdr + 6), method = get16(hdr + 8), nlen = get16(hdr + 26), xlen = get16(hdr + 28);
+        uint32_t crc = get32(hdr + 14);
+        uint64_t csize = get32(hdr + 18), usize = get32(hdr + 22);
+        if (nlen == 0 || nlen >= sizeof(name) || ar_read(&ar, name, nlen) != 0 || ar_read(&ar, extra, xlen) != 0) {
+            fprintf(stderr, RED "\nError: Corrupt entry header.\n" RESET);
+            errors++;
+            break;
+        }
+        name[nlen] = '\0';
+
+        mode_t mode = name[nlen - 1] == '/' ? S_IFDIR | 0755 : S_IFREG | 0644;
+        time_t mtime = 0;
+        int zip64 = 0;
+        for (size_t off = 0; off + 4 <= xlen;) {
+            uint16_t id = get16(extra + off), sz = get16(extra + off + 2);
+            const unsigned char *d = extra + off + 4;
+            if (off + 4 + sz > xlen) break;
+            if (id == ZIP_EXTRA_ZIP64) {
+                zip64 = 1;
+                if (usize == ZIP_MAX32 && sz >= 8) usize = get64(d);
+                if (csize == ZIP_MAX32 && sz >= 16) csize = get64(d + 8);
+            } else if (id == ZIP_EXTRA_TIME && sz >= 5 && (d[0] & 1)) {
+                mtime = get32(d + 1);
+            } else if (id == ZIP_EXTRA_ASI && sz >= 14) {
+                mode = get16(d + 4);
+            }
+            off += 4 + sz;
+        }
+        if ((flags & 1) || (method != 0 && method != 8) || (method == 0 && (flags & ZIP_FLAG_DESC))) {
+            fprintf(stderr, RED "\nError: Unsupported entry %s (encrypted or unknown method).\n" RESET, name);
+            errors++;
+            break;
+        }
+
+        int legacy = files == 0 && !deferred.n && strcmp(name, "-") == 0;
+        int keep = legacy || safe_entry_name(name);
+        if (!keep) { fprintf(stderr, RED "\nWarning: Skipped unsafe entry %s\n" RESET, name); errors++; }
+        for (size_t len = strlen(name); len > 1 && name[len - 1] == '/';) name[--len] = '\0';
+
+        /* Parents are opened with O_NOFOLLOW and links are only made at the end,
+         * so no entry can be written through a symlink */
+        const char *leaf = name;
+        int pfd = keep && !legacy ? open_entry_parent(dest_fd, name, &leaf) : -1;
+        if (keep && !legacy && pfd < 0) { fprintf(stderr, RED "\nWarning: Skipped %s, a parent directory is a symlink\n" RESET, name); errors++; keep = 0; }
+
+        int out = -1;
+        char target[PATH_MAX];
+        int is_link = keep && S_ISLNK(mode) && method == 0 && csize < sizeof(target);
+        if (keep && !legacy && S_ISREG(mode)) {
+            unlinkat(pfd, leaf, 0);
+            out = openat(pfd, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+            if (out < 0) { fprintf(stderr, RED "\nError: Could not write %s\n" RESET, name); errors++; }
+        } else if (keep && !legacy && S_ISDIR(mode)) {
+            mkdirat(pfd, leaf, 0700);
+        }
+
+        uint32_t got_crc;
+        uint64_t written;
+        int rc;
+        if (legacy) {
+            struct legacy_reader lr = { .ar = &ar, .method = method, .left = csize, .shown = -1 };
+            rc = method == 8 && inflateInit2(&lr.z, -15) != Z_OK ? -1 : 0;
+            if (rc == 0) {
+                printf("Restoring legacy backup from stream...\n");
+                errors += restore_legacy_tar(&lr, dest);
+                /* The rest of the entry is tar padding, read so the CRC covers it */
+                while ((rc = legacy_pull(&lr, (unsigned char *)extra, sizeof(extra))) > 0) lr.processed += rc;
+                if (method == 8) inflateEnd(&lr.z);
+            }
+            got_crc = lr.crc;
+            written = lr.processed;
+            files = -1;
+        } else if (is_link) {
+            rc = ar_read(&ar, target, csize);
+            target[rc == 0 ? csize : 0] = '\0';
+            got_crc = crc32(0, (unsigned char *)target, rc == 0 ? csize : 0);
+            written = csize;
+        } else {
+            rc = ar_extract(&ar, method, csize, out, &got_crc, &written);
+        }
+        if (rc == 0 && (flags & ZIP_FLAG_DESC)) {
+            unsigned char desc[24];
+            rc = ar_read(&ar, desc, 4);
+            int has_sig = rc == 0 && get32(desc) == ZIP_SIG_DESC;
+            size_t rest = (zip64 ? 16 : 8) + (has_sig ? 4 : 0);
+            if (rc == 0) rc = ar_read(&ar, desc + 4, rest);
+            if (rc == 0) crc = get32(has_sig ? desc + 4 : desc);
+        }
+        if (rc != 0) {
+            fprintf(stderr, RED "\nError: Archive data for %s is truncated or corrupt.\n" RESET, name);
+            errors++;
+            if (out >= 0) { close(out); unlinkat(pfd, leaf, 0); }
+            if (pfd >= 0) close(pfd);
+            break;
+        }
+        if (got_crc != crc) { fprintf(stderr, RED "\nError: CRC mismatch for %s\n" RESET, name); errors++; }
+
+        struct timespec ts[2] = { { 0, UTIME_OMIT }, { mtime, 0 } };
+        if (out >= 0) {
+            fchmod(out, mode & 07777);
+            if (mtime) futimens(out, ts);
+            if (close(out) != 0) errors++;
+            bytes += written;
+            if (++files % 256 == 0) { printf("\rRestoring: %d files, %.2f MB", files, (double)bytes / (1024 * 1024)); fflush(stdout); }
+        } else if (is_link) {
+            defer_entry(&deferred, 's', name, target)->mtime_ns = mtime ? (long long)mtime * 1000000000LL : -1;
+        } else if (keep && S_ISDIR(mode)) {
+            /* Applied at the end so read-only directories can still be filled */
+            struct deferred_entry *d = defer_entry(&deferred, 'd', name, NULL);
+            d->mode = mode;
+            d->mtime_ns = mtime ? (long long)mtime * 1000000000LL : -1;
+        }
+        if (pfd >= 0) close(pfd);
+    }
+    if (files >= 0) printf("\rRestoring: %d files, %.2f MB", files, (double)bytes / (1024 * 1024));
+    errors += apply_deferred(dest_fd, &deferred);
+    close(dest_fd);
+    cipher_free(&bc);
+    free(ar.buf); free(ar.raw);
+    return errors;
+}
+
 /* --------------------------------------------------
  * Core Handlers
  * -------------------------------------------------- */
 
-void handle_save() {
+void handle_save(int verify, int full) {
     if (!is_mounted()) { printf(YELLOW "Profile is not mounted in RAM.\n" RESET); return; }
     if (is_vivaldi_running()) { if (!confirm("Vivaldi is running. Save anyway?")) return; }
 
@@ -207,20 +2373,18 @@ void handle_save() {
     if (system(cmd) != 0) { printf(RED "Error: Could not unmount.\n" RESET); return; }
 
     printf("Syncing RAM to Disk...\n");
-    snprintf(cmd, sizeof(cmd), "rsync -a --delete --info=progress2 \"%s/\" \"%s/\"", PROFILE_RAM, PROFILE_SRC);
-    
-    FILE *fp = popen(cmd, "r");
-    if (fp) {
-        char line[512];
-        while (fgets(line, sizeof(line), fp)) {
-            int pct;
-            if (sscanf(line, "%*s %d%%", &pct) == 1) {
-                print_progress("Syncing", (double)pct / 100.0);
-            }
-        }
-        pclose(fp);
+    int errors = sync_tree(PROFILE_RAM, PROFILE_SRC, "Syncing");
+    printf("\n");
+    if (errors != 0) {
+        printf(RED "Error: Sync to disk incomplete. RAM copy kept at %s.\n" RESET, PROFILE_RAM);
+        return;
     }
-    
+
+    if (verify && verify_sync(PROFILE_RAM, PROFILE_SRC, full) != 0) {
+        printf(RED "\nVerification failed. RAM copy kept at %s.\n" RESET, PROFILE_RAM);
+        return;
+    }
+
     snprintf(cmd, sizeof(cmd), "rm -rf \"%s\"", PROFILE_RAM);
     system(cmd);
     printf(GREEN "\nProfile saved successfully.\n" RESET);
@@ -232,6 +2396,19 @@ void perform_restore(const char *zip_path) {
     if (!za) { printf(RED "Error: Failed to open ZIP: %s\n" RESET, zip_path); return; }
 
     zip_int64_t num_entries = zip_get_num_entries(za, 0);
+    const char *first = num_entries == 1 ? zip_get_name(za, 0, 0) : NULL;
+    if (first && strcmp(first, "-") == 0) {
+        struct zip_stat st;
+        zip_stat_index(za, 0, 0, &st);
+        struct legacy_reader lr = { .zf = zip_fopen_index(za, 0, 0), .total = st.size, .shown = -1 };
+        int errors = lr.zf ? restore_legacy_tar(&lr, PROFILE_SRC) : 1;
+        if (!lr.zf) printf(RED "Error: Could not open the legacy backup stream.\n" RESET);
+        else zip_fclose(lr.zf);
+        zip_close(za);
+        if (errors) printf(RED "Restore finished with errors.\n" RESET);
+        else printf(GREEN "Restore complete.\n" RESET);
+        return;
+    }
     zip_uint64_t total_size = 0;
     for (zip_int64_t i = 0; i < num_entries; i++) {
         struct zip_stat st;
@@ -239,113 +2416,183 @@ void perform_restore(const char *zip_path) {
         total_size += st.size;
     }
 
+    int dest_fd = open(PROFILE_SRC, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dest_fd < 0) { printf(RED "Error: Could not open %s\n" RESET, PROFILE_SRC); zip_close(za); return; }
+    struct deferred_list deferred = {0};
     zip_uint64_t processed = 0;
+    int errors = 0;
     for (zip_int64_t i = 0; i < num_entries; i++) {
         struct zip_stat st;
         zip_stat_index(za, i, 0, &st);
-        char out_path[PATH_BUFFER_MAX];
-        snprintf(out_path, sizeof(out_path), "%s/%s", PROFILE_SRC, st.name);
+        if (!safe_entry_name(st.name)) { printf(RED "\nSkipped unsafe entry: %s\n" RESET, st.name); errors++; continue; }
+        char rel[PATH_BUFFER_MAX];
+        snprintf(rel, sizeof(rel), "%s", st.name);
+        size_t len = strlen(rel);
+        int is_dir = rel[len - 1] == '/';
+        while (len > 1 && rel[len - 1] == '/') rel[--len] = '\0';
 
-        if (st.name[strlen(st.name) - 1] == '/') {
-            mkdir(out_path, 0755);
+        zip_uint8_t opsys;
+        zip_uint32_t attr;
+        mode_t mode = 0;
+        if (zip_file_get_external_attributes(za, i, 0, &opsys, &attr) == 0 && opsys == ZIP_OPSYS_UNIX) mode = attr >> 16;
+        long long mtime_ns = (st.valid & ZIP_STAT_MTIME) ? (long long)st.mtime * 1000000000LL : -1;
+
+        const char *leaf;
+        int pfd = open_entry_parent(dest_fd, rel, &leaf);
+        if (pfd < 0) { printf(RED "\nSkipped %s: a parent directory is a symlink or unwritable\n" RESET, rel); errors++; continue; }
+
+        if (is_dir) {
+            mkdirat(pfd, leaf, 0755);
+            struct deferred_entry *d = defer_entry(&deferred, 'd', rel, NULL);
+            d->mode = mode ? mode : 0755;
+            d->mtime_ns = mtime_ns;
+        } else if (S_ISLNK(mode)) {
+            struct zip_file *zf = zip_fopen_index(za, i, 0);
+            char target[PATH_MAX];
+            zip_int64_t n = zf ? zip_fread(zf, target, sizeof(target) - 1) : -1;
+            if (zf) zip_fclose(zf);
+            if (n >= 0) {
+                target[n] = '\0';
+                defer_entry(&deferred, 's', rel, target)->mtime_ns = mtime_ns;
+            }
         } else {
             struct zip_file *zf = zip_fopen_index(za, i, 0);
-            FILE *out = fopen(out_path, "wb");
-            if (zf && out) {
+            unlinkat(pfd, leaf, 0);
+            int out = zf ? openat(pfd, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644) : -1;
+            if (zf && out >= 0) {
                 char buffer[8192]; zip_int64_t n;
                 while ((n = zip_fread(zf, buffer, sizeof(buffer))) > 0) {
-                    fwrite(buffer, 1, n, out);
+                    if (write_all(out, buffer, n) != 0) { errors++; break; }
                     processed += n;
                     print_progress("Restoring", (double)processed / (total_size ? total_size : 1));
                 }
-                fclose(out); zip_fclose(zf);
+                struct timespec ts[2] = { { 0, UTIME_OMIT }, { mtime_ns / 1000000000LL, mtime_ns % 1000000000LL } };
+                if (mode) fchmod(out, mode & 07777);
+                if (mtime_ns >= 0) futimens(out, ts);
+            } else {
+                printf(RED "\nError: Could not write %s\n" RESET, rel);
+                errors++;
             }
+            if (out >= 0 && close(out) != 0) errors++;
+            if (zf) zip_fclose(zf);
         }
+        close(pfd);
     }
+    errors += apply_deferred(dest_fd, &deferred);
+    close(dest_fd);
     zip_close(za);
-    printf(GREEN "\nRestore complete.\n" RESET);
+    if (errors) printf(RED "\nRestore finished with errors.\n" RESET);
+    else printf(GREEN "\nRestore complete.\n" RESET);
 }
 
-void handle_restore(int interactive) {
-    if (!is_mounted()) { printf(RED "Error: RAM profile not active.\n" RESET); return; }
-    DIR *d = opendir(BACKUP_DIR);
-    if (!d) { printf(RED "Error: Backup directory not found.\n" RESET); return; }
-
-    struct dirent *dir;
-    char files[128][PATH_BUFFER_MAX]; time_t times[128]; int count = 0;
-    while ((dir = readdir(d)) != NULL && count < 128) {
-        if (strstr(dir->d_name, ".zip")) {
-            snprintf(files[count], sizeof(files[count]), "%s/%s", BACKUP_DIR, dir->d_name);
-            struct stat st; stat(files[count], &st);
-            times[count] = st.st_mtime; count++;
-        }
+/* Returns 1 if --keyfile/--keyring supplied a key, 0 if neither was given, -1 on error */
+/* Value of a key option given as "--flag VALUE" or "--flag=VALUE". A flag
+ * without a usable value sets *bad, so the backup is never silently left unencrypted. */
+const char *key_flag_value(int argc, char *argv[], const char *flag, int *bad) {
+    size_t len = strlen(flag);
+    for (int i = 2; i < argc; i++) {
+        const char *v;
+        if (strcmp(argv[i], flag) == 0) v = i + 1 < argc ? argv[i + 1] : NULL;
+        else if (strncmp(argv[i], flag, len) == 0 && argv[i][len] == '=') v = argv[i] + len + 1;
+        else continue;
+        if (!v || !v[0] || v[0] == '-') { fprintf(stderr, RED "Error: %s needs a value.\n" RESET, flag); *bad = 1; return NULL; }
+        return v;
     }
-    closedir(d);
-    if (count == 0) { printf(RED "Error: No backups found.\n" RESET); return; }
+    return NULL;
+}
+
+/* Returns 1 with key filled, 0 when neither key option is given, -1 on error */
+int backup_key_from_args(int argc, char *argv[], unsigned char key[32]) {
+    int bad = 0;
+    const char *file = key_flag_value(argc, argv, "--keyfile", &bad), *desc = key_flag_value(argc, argv, "--keyring", &bad);
+    if (bad) return -1;
+    if (file && desc) { fprintf(stderr, RED "Error: Use either --keyfile or --keyring, not both.\n" RESET); return -1; }
+    if (!file && !desc) return 0;
+    return load_backup_key(file, desc, key) == 0 ? 1 : -1;
+}
+
+void handle_restore(int interactive, const unsigned char *key) {
+    if (!is_mounted()) { printf(RED "Error: RAM profile not active.\n" RESET); return; }
+    struct sync_list backups = {0};
+    if (list_backups(&backups) != 0) { printf(RED "Error: Backup directory not found.\n" RESET); return; }
+    int count = backups.n;
+    if (count == 0) { printf(RED "Error: No backups found.\n" RESET); sync_list_free(&backups); return; }
 
     int pick = 0;
     if (interactive) {
         printf("\nAvailable Backups:\n");
         for (int i = 0; i < count; i++) {
-            struct stat st; stat(files[i], &st);
-            printf("[%d] %s " ORANGE "(%.2f MB)" RESET "\n", i + 1, basename(files[i]), (double)st.st_size / (1024 * 1024));
+            printf("[%d] %s " ORANGE "(%.2f MB)" RESET "\n", i + 1, backups.v[i].rel, (double)backups.v[i].size / (1024 * 1024));
         }
         printf("Select (1-%d) or 'x' to cancel: ", count);
         char input[10];
-        if (!fgets(input, sizeof(input), stdin)) return;
+        if (!fgets(input, sizeof(input), stdin)) { sync_list_free(&backups); return; }
         if (input[0] == 'x' || input[0] == 'X') {
             printf("\nRestore cancelled.\n");
+            sync_list_free(&backups);
             return;
         }
         pick = atoi(input);
         if (pick < 1 || pick > count) {
             printf(RED "Invalid selection.\n" RESET);
+            sync_list_free(&backups);
             return;
         }
         pick--;
     } else {
-        for (int i = 1; i < count; i++) if (times[i] > times[pick]) pick = i;
+        for (int i = 1; i < count; i++) if (backups.v[i].mtime_ns > backups.v[pick].mtime_ns) pick = i;
     }
-    perform_restore(files[pick]);
+    char path[PATH_BUFFER_MAX];
+    snprintf(path, sizeof(path), "%s/%s", BACKUP_DIR, backups.v[pick].rel);
+    sync_list_free(&backups);
+    if (!is_encrypted_backup(path)) { perform_restore(path); return; }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { printf(RED "Error: Failed to open backup: %s\n" RESET, path); return; }
+    int errors = restore_stream(fd, PROFILE_SRC, key);
+    close(fd);
+    if (errors != 0) printf(RED "\nRestore finished with errors.\n" RESET);
+    else printf(GREEN "\nRestore complete.\n" RESET);
+}
+
+int handle_restore_stream(const unsigned char *key) {
+    if (!is_mounted()) { printf(RED "Error: RAM profile not active.\n" RESET); return 1; }
+    if (isatty(STDIN_FILENO)) { printf(RED "Error: Pipe a backup into stdin to use --restore -.\n" RESET); return 1; }
+    printf("Restoring from stdin...\n");
+    int errors = restore_stream(STDIN_FILENO, PROFILE_SRC, key);
+    if (errors != 0) { printf(RED "\nRestore finished with errors.\n" RESET); return 1; }
+    printf(GREEN "\nRestore complete.\n" RESET);
+    return 0;
 }
 
 void handle_clean_backups() {
-    DIR *d = opendir(BACKUP_DIR);
-    if (!d) return;
-    struct dirent *dir;
-    char latest[PATH_MAX] = ""; time_t ltime = 0;
-    while ((dir = readdir(d))) {
-        if (strstr(dir->d_name, ".zip")) {
-            char p[PATH_BUFFER_MAX]; snprintf(p, sizeof(p), "%s/%s", BACKUP_DIR, dir->d_name);
-            struct stat st; stat(p, &st);
-            if (st.st_mtime > ltime) { ltime = st.st_mtime; strncpy(latest, dir->d_name, PATH_MAX); }
-        }
-    }
-    rewinddir(d);
-    while ((dir = readdir(d))) {
-        if (strstr(dir->d_name, ".zip") && strcmp(dir->d_name, latest) != 0) {
-            char p[PATH_BUFFER_MAX]; snprintf(p, sizeof(p), "%s/%s", BACKUP_DIR, dir->d_name);
+    struct sync_list backups = {0};
+    if (list_backups(&backups) != 0) return;
+    char latest[PATH_MAX] = ""; long long ltime = 0;
+    for (size_t i = 0; i < backups.n; i++) {
+        if (backups.v[i].mtime_ns > ltime) { ltime = backups.v[i].mtime_ns; snprintf(latest, sizeof(latest), "%s", backups.v[i].rel); }
+    }
+    for (size_t i = 0; i < backups.n; i++) {
+        if (strcmp(backups.v[i].rel, latest) != 0) {
+            char p[PATH_BUFFER_MAX]; snprintf(p, sizeof(p), "%s/%s", BACKUP_DIR, backups.v[i].rel);
             remove(p);
         }
     }
-    closedir(d);
+    sync_list_free(&backups);
     printf(GREEN "\nOld backups cleaned. Kept: %s\n" RESET, latest);
 }
 
 void handle_purge_backups() {
     if (!confirm("Are you sure you want to delete ALL backup files?")) return;
-    DIR *d = opendir(BACKUP_DIR);
-    if (!d) { printf(YELLOW "Backup directory does not exist.\n" RESET); return; }
-    struct dirent *dir;
+    struct sync_list backups = {0};
+    if (list_backups(&backups) != 0) { printf(YELLOW "Backup directory does not exist.\n" RESET); return; }
     int deleted_count = 0;
-    while ((dir = readdir(d))) {
-        if (strstr(dir->d_name, ".zip")) {
-            char p[PATH_BUFFER_MAX];
-            snprintf(p, sizeof(p), "%s/%s", BACKUP_DIR, dir->d_name);
-            if (remove(p) == 0) deleted_count++;
-        }
+    for (size_t i = 0; i < backups.n; i++) {
+        char p[PATH_BUFFER_MAX];
+        snprintf(p, sizeof(p), "%s/%s", BACKUP_DIR, backups.v[i].rel);
+        if (remove(p) == 0) deleted_count++;
     }
-    closedir(d);
+    sync_list_free(&backups);
     printf(GREEN "\nPurged %d backup files.\n" RESET, deleted_count);
 }
 
@@ -368,30 +2615,32 @@ int main(int argc, char *argv[]) {
             fclose(f); system("systemctl --user daemon-reload && systemctl --user enable vivaldi-ram-profile.service");
             printf(GREEN "Service installed and enabled.\n" RESET);
         }
+        /* The sleep hook runs a root-owned copy, so nothing writable by the user is executed as root */
+        char hook_tmp[] = "/tmp/vrpm-hook-XXXXXX";
+        int hfd = mkstemp(hook_tmp);
+        if (hfd >= 0) {
+            dprintf(hfd, "#!/bin/sh\n# Flush the Vivaldi RAM profile to disk before suspend/hibernate\n[ \"$1\" = pre ] || exit 0\nHOME='%s' exec timeout -k 1 3 %s --checkpoint\n", getenv("HOME"), CHECKPOINT_BIN);
+            close(hfd);
+            snprintf(cmd, sizeof(cmd), "sudo install -D -m 755 \"%s\" \"%s\" && sudo install -D -m 755 \"%s\" \"%s\"", INSTALL_PATH, CHECKPOINT_BIN, hook_tmp, CHECKPOINT_HOOK);
+            if (system(cmd) == 0) printf(GREEN "Sleep checkpoint hook installed.\n" RESET);
+            else printf(YELLOW "Warning: Could not install the sleep checkpoint hook.\n" RESET);
+            unlink(hook_tmp);
+        }
     } 
     else if (strcmp(action, "--load") == 0 || strcmp(action, "-l") == 0) {
-        if (!is_rsync_installed()) {
-            printf(RED "Error: 'rsync' is not installed. Please install it to continue.\n" RESET);
-            return 1;
-        }
         if (is_mounted()) { printf(YELLOW "Already in RAM.\n" RESET); return 0; }
         
         char cmd[CMD_MAX];
         snprintf(cmd, sizeof(cmd), "mkdir -p %s", PROFILE_RAM); system(cmd);
         
         printf("Copying profile to RAM...\n");
-        snprintf(cmd, sizeof(cmd), "rsync -a --delete --info=progress2 \"%s/\" \"%s/\"", PROFILE_SRC, PROFILE_RAM);
-        FILE *fp = popen(cmd, "r");
-        if (fp) {
-            char line[512];
-            while (fgets(line, sizeof(line), fp)) {
-                int pct;
-                if (sscanf(line, "%*s %d%%", &pct) == 1) {
-                    print_progress("Loading", (double)pct / 100.0);
-                }
-            }
-            pclose(fp);
-            printf("\n");
+        int errors = sync_tree(PROFILE_SRC, PROFILE_RAM, "Loading");
+        printf("\n");
+        if (errors != 0) { printf(RED "Error: Could not copy profile to RAM. Profile not mounted.\n" RESET); return 1; }
+
+        if (has_flag(argc, argv, "--verify-sync") && verify_sync(PROFILE_RAM, PROFILE_SRC, has_flag(argc, argv, "--full")) != 0) {
+            printf(RED "Error: Verification failed. Profile not mounted.\n" RESET);
+            return 1;
         }
 
         snprintf(cmd, sizeof(cmd), "sudo mount --bind \"%s\" \"%s\"", PROFILE_RAM, PROFILE_SRC); 
@@ -401,20 +2650,50 @@ int main(int argc, char *argv[]) {
             printf(RED "Error: Failed to mount profile.\n" RESET);
         }
     }
-    else if (strcmp(action, "--save") == 0 || strcmp(action, "-s") == 0) handle_save();
+    else if (strcmp(action, "--save") == 0 || strcmp(action, "-s") == 0) handle_save(has_flag(argc, argv, "--verify-sync"), has_flag(argc, argv, "--full"));
+    else if (strcmp(action, "--checkpoint") == 0) return handle_checkpoint();
+    else if (strcmp(action, "--verify-sync") == 0 || strcmp(action, "-V") == 0) return handle_verify_sync(has_flag(argc, argv, "--full"));
     else if (strcmp(action, "--backup") == 0 || strcmp(action, "-b") == 0) {
         if (!is_mounted()) { printf(RED "Error: RAM profile not active.\n" RESET); return 1; }
+        unsigned char key[32];
+        int have_key = backup_key_from_args(argc, argv, key);
+        if (have_key < 0) return 1;
+        if (has_flag(argc, argv, "-")) {
+            if (isatty(STDOUT_FILENO)) { fprintf(stderr, RED "Error: Refusing to write a backup to a terminal.\n" RESET); return 1; }
+            /* The archive keeps the original stdout; all messages move to stderr */
+            int out = dup(STDOUT_FILENO);
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+            printf("Streaming backup to stdout...\n");
+            int rc = write_backup(PROFILE_SRC, out, have_key ? key : NULL);
+            OPENSSL_cleanse(key, sizeof(key));
+            if (close(out) != 0) rc = -1;
+            if (rc != 0) { printf(RED "\nError: Backup failed.\n" RESET); return 1; }
+            printf(GREEN "\nBackup done.\n" RESET);
+            return 0;
+        }
         char cmd[CMD_MAX], ts[64], b_path[PATH_BUFFER_MAX];
         snprintf(cmd, sizeof(cmd), "mkdir -p \"%s\"", BACKUP_DIR); system(cmd);
         time_t now = time(NULL); strftime(ts, sizeof(ts), "%Y-%m-%d_%H-%M-%S", localtime(&now));
-        snprintf(b_path, sizeof(b_path), "%s/vivaldi-profile-%s.zip", BACKUP_DIR, ts);
-        unsigned long total_size = get_dir_size(PROFILE_SRC);
+        snprintf(b_path, sizeof(b_path), "%s/vivaldi-profile-%s.zip%s", BACKUP_DIR, ts, have_key ? ".enc" : "");
         printf("Backing up to: %s\n", b_path);
-        snprintf(cmd, sizeof(cmd), "cd \"%s\" && tar -cf - . | pv -s %lu | zip -q -9 \"%s\" -", PROFILE_SRC, total_size, b_path);
-        system(cmd); printf(GREEN "\nBackup done.\n" RESET);
+        int fd = open(b_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0) { printf(RED "Error: Could not create %s\n" RESET, b_path); return 1; }
+        int rc = write_backup(PROFILE_SRC, fd, have_key ? key : NULL);
+        OPENSSL_cleanse(key, sizeof(key));
+        if (close(fd) != 0) rc = -1;
+        if (rc != 0) { remove(b_path); printf(RED "\nError: Backup failed.\n" RESET); return 1; }
+        printf(GREEN "\nBackup done.\n" RESET);
+    }
+    else if (strcmp(action, "--restore") == 0 || strcmp(action, "-R") == 0 ||
+             strcmp(action, "--restore-select") == 0 || strcmp(action, "-e") == 0) {
+        unsigned char key[32];
+        int have_key = backup_key_from_args(argc, argv, key), rc = 0;
+        if (have_key < 0) return 1;
+        if (has_flag(argc, argv, "-")) rc = handle_restore_stream(have_key ? key : NULL);
+        else handle_restore(action[1] == 'e' || strcmp(action, "--restore-select") == 0, have_key ? key : NULL);
+        OPENSSL_cleanse(key, sizeof(key));
+        return rc;
     }
-    else if (strcmp(action, "--restore") == 0 || strcmp(action, "-R") == 0) handle_restore(0);
-    else if (strcmp(action, "--restore-select") == 0 || strcmp(action, "-e") == 0) handle_restore(1);
     else if (strcmp(action, "--clean-backup") == 0 || strcmp(action, "-n") == 0) handle_clean_backups();
     else if (strcmp(action, "--purge-backup") == 0 || strcmp(action, "-p") == 0) handle_purge_backups();
     else if (strcmp(action, "--sudo-help") == 0 || strcmp(action, "-h") == 0) show_sudo_help();